@@ -26,6 +26,7 @@ SOFTWARE.
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <limits.h>
 #include <math.h>
@@ -34,361 +35,2826 @@ SOFTWARE.
 #include "morton_ispc.h"
 #include "alloc_ispc.h"
 #include "part_ispc.h"
+#include "rcb_ispc.h"
+#include "migrate_ispc.h"
 #include "dynlb.h"
 
+/* number of histogram bins and refinement rounds of the parallel rcb median search */
+#define PRCB_BINS 64
+#define PRCB_ROUNDS 8
+
+/* number of bins per splitter refinement round of the morton balancer and the morton code range */
+#define MORTON_BINS 64
+#define MORTON_RANGE ((uint64_t)1<<63)
+
+/* splitters of the previous morton and hilbert balancer calls; attached to the communicator as the starting guess
+ * of the next call on it and freed together with it */
+struct curve_splitters
+{
+  int count[2]; /* morton, hilbert */
+  uint64_t *code[2];
+};
+
+static int curve_splitters_keyval = MPI_KEYVAL_INVALID;
+
+/* free splitters of a freed communicator */
+static int curve_splitters_delete (MPI_Comm comm, int keyval, void *attr, void *extra)
+{
+  struct curve_splitters *sp = attr;
+
+  free (sp->code[0]);
+  free (sp->code[1]);
+  free (sp);
+
+  return MPI_SUCCESS;
+}
+
+/* get splitters attached to a communicator; attach empty ones first */
+static struct curve_splitters* curve_splitters_get (MPI_Comm comm)
+{
+  struct curve_splitters *sp;
+  int flag;
+
+  if (curve_splitters_keyval == MPI_KEYVAL_INVALID)
+  {
+    MPI_Comm_create_keyval (MPI_COMM_NULL_COPY_FN, curve_splitters_delete, &curve_splitters_keyval, NULL);
+  }
+
+  MPI_Comm_get_attr (comm, curve_splitters_keyval, &sp, &flag);
+
+  if (!flag)
+  {
+    ERRMEM (sp = calloc (1, sizeof(struct curve_splitters)));
+
+    MPI_Comm_set_attr (comm, curve_splitters_keyval, sp);
+  }
+
+  return sp;
+}
+
+/* global extents of points; maxima are negated so that a single MIN reduction suffices */
+static void global_extents (MPI_Comm comm, int ntasks, int n, REAL *point[3], REAL extents[6])
+{
+  _dynlb_extents_of_points (ntasks, n, point, extents);
+
+  extents[3] = -extents[3];
+  extents[4] = -extents[4];
+  extents[5] = -extents[5];
+
+  MPI_Allreduce (MPI_IN_PLACE, extents, 6, MPI_REAL, MPI_MIN, comm);
+
+  extents[3] = -extents[3];
+  extents[4] = -extents[4];
+  extents[5] = -extents[5];
+}
+
+/* extend extents to a cube of their largest width, so that codes quantize all axes alike */
+static void cubic_extents (REAL extents[6])
+{
+  REAL w = MAX (extents[3]-extents[0], MAX (extents[4]-extents[1], extents[5]-extents[2]));
+
+  extents[3] = extents[0] + w;
+  extents[4] = extents[1] + w;
+  extents[5] = extents[2] + w;
+}
+
+/* morton (or hilbert) ordering based point balancer on a communicator */
+static void curve_balance (MPI_Comm comm, int n, REAL *point[3], int ranks[], int hilbert)
+{
+  int size, rank, gn, i, j, k, l, s, m, r, active, pos, *order, *target, *lcount, *gcount, *below, *offset;
+  uint64_t *code, *lo, *hi, *bound, step;
+  struct curve_splitters *sp;
+  REAL extents[6];
+
+  MPI_Comm_size (comm, &size);
+  MPI_Comm_rank (comm, &rank);
+
+  sp = curve_splitters_get (comm);
+
+  global_extents (comm, 0, n, point, extents);
+
+  MPI_Allreduce (&n, &gn, 1, MPI_INT, MPI_SUM, comm);
+
+  /* local morton codes within global extents */
+  ERRMEM (code = _dynlb_aligned_uint64_alloc (n));
+
+  ERRMEM (order = _dynlb_aligned_int_alloc (n));
+
+  if (hilbert) _dynlb_hilbert_ordering_extents (0, n, point, extents, code, order);
+  else _dynlb_morton_ordering_extents (0, n, point, extents, code, order);
+
+  m = gn / size;
+
+  r = gn % size; /* remainder r is distributed to first r ranks */
+
+  k = size - 1; /* number of splitters */
+
+  ERRMEM (target = malloc (MAX(k,1) * sizeof(int)));
+  ERRMEM (lo = malloc (MAX(k,1) * sizeof(uint64_t)));
+  ERRMEM (hi = malloc (MAX(k,1) * sizeof(uint64_t)));
+  ERRMEM (below = malloc (MAX(k,1) * sizeof(int)));
+  ERRMEM (offset = malloc (MAX(k,1) * sizeof(int)));
+  ERRMEM (bound = malloc (MAX(k,1) * (MORTON_BINS-1) * sizeof(uint64_t)));
+  ERRMEM (lcount = malloc (MAX(k,1) * (MORTON_BINS-1) * sizeof(int)));
+  ERRMEM (gcount = malloc (MAX(k,1) * (MORTON_BINS-1) * sizeof(int)));
+
+  /* splitter j is the code at global sorted position target[j], where rank j+1 starts;
+   * it is searched for in the [lo[j], hi[j]) interval, such that count(<lo[j]) <= target[j] < count(<hi[j]) */
+  for (j = 0; j < k; j ++)
+  {
+    target[j] = (j+1)*m + MIN(j+1, r);
+
+    if (target[j] < gn)
+    {
+      lo[j] = 0;
+      hi[j] = MORTON_RANGE;
+    }
+    else /* no such position; all points are below */
+    {
+      lo[j] = MORTON_RANGE;
+      hi[j] = MORTON_RANGE+1;
+    }
+  }
+
+  if (sp->count[hilbert] == k && k > 0) /* bracket targets between previous splitters */
+  {
+    for (j = 0; j < k; j ++)
+    {
+      bound[2*j] = sp->code[hilbert][j];
+      bound[2*j+1] = sp->code[hilbert][j]+1;
+    }
+
+    _dynlb_morton_count (n, code, 2*k, bound, lcount);
+
+    MPI_Allreduce (lcount, gcount, 2*k, MPI_INT, MPI_SUM, comm);
+
+    for (j = 0; j < k; j ++)
+    {
+      if (hi[j] - lo[j] == 1) continue;
+
+      for (l = 0; l < 2*k; l ++)
+      {
+	if (gcount[l] <= target[j]) lo[j] = MAX (lo[j], bound[l]);
+	else hi[j] = MIN (hi[j], bound[l]);
+      }
+    }
+  }
+
+  for (;;) /* histogram refinement rounds */
+  {
+    for (active = j = 0; j < k; j ++)
+    {
+      if (hi[j] - lo[j] > 1) active ++;
+    }
+
+    if (!active) break;
+
+    for (j = 0; j < k; j ++)
+    {
+      step = (hi[j] - lo[j] + MORTON_BINS-1) / MORTON_BINS;
+
+      for (s = 1; s < MORTON_BINS; s ++)
+      {
+	bound[j*(MORTON_BINS-1)+s-1] = MIN (lo[j] + s*step, hi[j]);
+      }
+    }
+
+    _dynlb_morton_count (n, code, k*(MORTON_BINS-1), bound, lcount);
+
+    MPI_Allreduce (lcount, gcount, k*(MORTON_BINS-1), MPI_INT, MPI_SUM, comm);
+
+    for (j = 0; j < k; j ++)
+    {
+      if (hi[j] - lo[j] == 1) continue;
+
+      for (s = 0; s < MORTON_BINS-1; s ++)
+      {
+	l = j*(MORTON_BINS-1)+s;
+
+	if (gcount[l] <= target[j]) lo[j] = MAX (lo[j], bound[l]);
+	else hi[j] = MIN (hi[j], bound[l]);
+      }
+    }
+  }
+
+  /* splitters are lo[]; points with codes equal to a splitter are ordered globally by rank */
+  for (j = 0; j < k; j ++)
+  {
+    bound[2*j] = lo[j];
+    bound[2*j+1] = lo[j]+1;
+  }
+
+  _dynlb_morton_count (n, code, 2*k, bound, lcount);
+
+  for (j = 0; j < k; j ++)
+  {
+    gcount[j] = lcount[2*j]; /* local number of codes below lo[j] */
+    gcount[k+j] = lcount[2*j+1] - lcount[2*j]; /* local number of codes equal to lo[j] */
+  }
+
+  MPI_Allreduce (gcount, below, k, MPI_INT, MPI_SUM, comm);
+
+  MPI_Exscan (gcount+k, offset, k, MPI_INT, MPI_SUM, comm);
+
+  if (rank == 0)
+  {
+    for (j = 0; j < k; j ++) offset[j] = 0;
+  }
+
+  for (i = j = 0; i < n; i ++)
+  {
+    while (j < k && lo[j] < code[i]) j ++;
+
+    if (j < k && lo[j] == code[i]) /* global sorted position decides */
+    {
+      pos = below[j] + offset[j] + (i - lcount[2*j]);
+
+      ranks[order[i]] = pos < r*(m+1) ? pos/(m+1) : r + (pos - r*(m+1))/m;
+    }
+    else ranks[order[i]] = j;
+  }
+
+  /* remember splitters */
+  if (sp->count[hilbert] != k)
+  {
+    free (sp->code[hilbert]);
+    ERRMEM (sp->code[hilbert] = malloc (MAX(k,1) * sizeof(uint64_t)));
+    sp->count[hilbert] = k;
+  }
+
+  memcpy (sp->code[hilbert], lo, k * sizeof(uint64_t));
+
+  _dynlb_aligned_uint64_free (code);
+  _dynlb_aligned_int_free (order);
+  free (target);
+  free (lo);
+  free (hi);
+  free (below);
+  free (offset);
+  free (bound);
+  free (lcount);
+  free (gcount);
+}
+
 /* simple morton ordering based point balancer */
 void dynlb_morton_balance (int n, REAL *point[3], int ranks[])
 {
-  int size, rank, *vn, *dn, gn, i, j, k, m, r, *gorder, *granks;
-  unsigned int *gcode;
-  REAL *gpoint[3];
+  curve_balance (MPI_COMM_WORLD, n, point, ranks, 0);
+}
+
+/* simple morton ordering based point balancer on a communicator */
+void dynlb_morton_balance_comm (MPI_Comm comm, int n, REAL *point[3], int ranks[])
+{
+  curve_balance (comm, n, point, ranks, 0);
+}
+
+/* simple hilbert ordering based point balancer */
+void dynlb_hilbert_balance (int n, REAL *point[3], int ranks[])
+{
+  curve_balance (MPI_COMM_WORLD, n, point, ranks, 1);
+}
+
+/* simple hilbert ordering based point balancer on a communicator */
+void dynlb_hilbert_balance_comm (MPI_Comm comm, int n, REAL *point[3], int ranks[])
+{
+  curve_balance (comm, n, point, ranks, 1);
+}
+
+/* shared memory node layout of hierarchical partitioning and node shared trees */
+struct nodes
+{
+  MPI_Comm local; /* ranks of this node */
+  MPI_Comm leaders; /* first ranks of all nodes; MPI_COMM_NULL on other ranks */
+  int count; /* number of nodes */
+  int index; /* index of this node */
+  int *node; /* node index of each rank */
+  int *ranks; /* number of ranks of each node */
+  int *root; /* partitioning subtree root of each node */
+  MPI_Win window; /* node shared partitioning tree; MPI_WIN_NULL when trees are private */
+  MPI_Win qwindow; /* node shared query tree compiled by node leaders; MPI_WIN_NULL when private */
+};
+
+/* map leaf_count leaves in leaf order onto ranks of relative capacities and output each leaf's rank and share:
+ * leaf i goes to rank i when there are as many leaves as ranks; otherwise leaves are assigned to ranks where
+ * their middles fall within the capacity prefix and share their rank's capacity equally */
+static void leaf_shares (int leaf_count, int size, REAL *capacity, int *leaf_rank, REAL *share)
+{
+  int i, r, *count;
+  REAL acc;
+
+  if (leaf_count == size)
+  {
+    for (i = 0; i < size; i ++)
+    {
+      leaf_rank[i] = i;
+      share[i] = capacity[i];
+    }
+
+    return;
+  }
+
+  ERRMEM (count = calloc (size, sizeof(int)));
+
+  for (acc = capacity[0], r = i = 0; i < leaf_count; i ++)
+  {
+    while (r < size-1 && ((REAL) i + 0.5) / (REAL) leaf_count > acc) acc += capacity[++ r];
+
+    leaf_rank[i] = r;
+
+    count[r] ++;
+  }
+
+  for (i = 0; i < leaf_count; i ++) share[i] = capacity[leaf_rank[i]] / (REAL) count[leaf_rank[i]];
+
+  free (count);
+}
+
+/* set leaf ranks in leaf order */
+static void set_leaf_ranks (struct partitioning *ptree, int node, int *leaf_rank, int *i)
+{
+  if (ptree[node].dimension >= 0)
+  {
+    set_leaf_ranks (ptree, ptree[node].left, leaf_rank, i);
+    set_leaf_ranks (ptree, ptree[node].right, leaf_rank, i);
+  }
+  else ptree[node].rank = leaf_rank[(*i) ++];
+}
+
+/* capacity share of each tree node given assigned leaf ranks; leaves of a rank share its capacity equally */
+static void node_shares (struct partitioning *ptree, int tree_size, int size, REAL *capacity, REAL *share)
+{
+  int i, *count;
+
+  ERRMEM (count = calloc (size, sizeof(int)));
+
+  for (i = 0; i < tree_size; i ++)
+  {
+    if (ptree[i].dimension < 0) count[ptree[i].rank] ++;
+  }
+
+  for (i = tree_size-1; i >= 0; i --) /* children follow parents in tree order */
+  {
+    if (ptree[i].dimension < 0) share[i] = capacity[ptree[i].rank] / (REAL) count[ptree[i].rank];
+    else share[i] = share[ptree[i].left] + share[ptree[i].right];
+  }
+
+  free (count);
+}
+
+/* calculate parallel rcb tree size */
+static void prcb_size (int n, int cutoff, int *tree_size)
+{
+  if (n > cutoff)
+  {
+    (*tree_size) += 2; /* two potential siblings */
+
+    prcb_size (n/2, cutoff, tree_size);
+    prcb_size (n-n/2, cutoff, tree_size);
+  }
+}
+
+/* initialize parallel rcb tree topology and count leaves below each node */
+static void prcb_init (int n, int cutoff, struct partitioning *ptree, int node, int *i, int *leaves)
+{
+  ptree[node].coord = 0.0;
+  ptree[node].rank = -1;
+
+  if (n > cutoff) /* node */
+  {
+    ptree[node].dimension = 3; /* mark as node; actual dimension 0,1 or 2 will be determined in prcb_descend */
+    ptree[node].left = ++(*i);
+    ptree[node].right = ++(*i);
+    ptree[node].size = -1;
+
+    prcb_init (n/2, cutoff, ptree, ptree[node].left, i, leaves);
+    prcb_init (n-n/2, cutoff, ptree, ptree[node].right, i, leaves);
+
+    leaves[node] = leaves[ptree[node].left] + leaves[ptree[node].right];
+  }
+  else /* leaf */
+  {
+    ptree[node].dimension = -1;
+    ptree[node].left = ptree[node].right = -1;
+    ptree[node].size = 0;
+
+    leaves[node] = 1;
+  }
+}
+
+/* count leaves below each node of an existing tree */
+static int prcb_leaves (struct partitioning *ptree, int node, int *leaves)
+{
+  if (ptree[node].dimension >= 0) /* node */
+  {
+    leaves[node] = prcb_leaves (ptree, ptree[node].left, leaves) + prcb_leaves (ptree, ptree[node].right, leaves);
+  }
+  else leaves[node] = 1;
+
+  return leaves[node];
+}
+
+/* descend the subtree at 'root' level by level while partitioning a local copy of points; when 'build' is set, split dimensions
+ * are selected and all split coordinates are computed; otherwise only split coordinates of nodes whose left subtree
+ * count deviates from its leaf share by more than 'tolerance' are corrected; split coordinates are found using
+ * a distributed histogram based median search; counts are weight sums when weight is not NULL; children receive counts
+ * proportional to their node shares when share is not NULL and to their leaf counts otherwise; results are stored in the tree
+ * only when 'write' is set (all ranks compute the same values, hence one writer per node suffices for a node shared tree);
+ * return the number of corrected nodes */
+static int prcb_descend (MPI_Comm comm, struct partitioning *ptree, int root, int *leaves, REAL *share, int n, REAL *point[3], REAL *weight,
+  REAL tolerance, int build, int write)
+{
+  int m, mm, j, l, r, d, node, active, corrected;
+  int *level, *next, *range, *nrange, *dimension, *split, *done, *tmp;
+  REAL *wpoint[3], *wweight, *extents, *lo, *hi, *coord, a, b, w;
+  double *lhist, *ghist, total, target, count;
+
+  /* local points are copied and then partitioned in place as the tree is descended */
+  ERRMEM (wpoint[0] = _dynlb_aligned_real_alloc (n));
+  ERRMEM (wpoint[1] = _dynlb_aligned_real_alloc (n));
+  ERRMEM (wpoint[2] = _dynlb_aligned_real_alloc (n));
+  memcpy (wpoint[0], point[0], n * sizeof(REAL));
+  memcpy (wpoint[1], point[1], n * sizeof(REAL));
+  memcpy (wpoint[2], point[2], n * sizeof(REAL));
+
+  if (weight)
+  {
+    ERRMEM (wweight = _dynlb_aligned_real_alloc (n));
+    memcpy (wweight, weight, n * sizeof(REAL));
+  }
+  else wweight = NULL;
+
+  m = leaves[root]; /* upper bound on the number of nodes per level */
+
+  ERRMEM (level = malloc (m * sizeof(int)));
+  ERRMEM (next = malloc (m * sizeof(int)));
+  ERRMEM (range = malloc (2 * m * sizeof(int)));
+  ERRMEM (nrange = malloc (2 * m * sizeof(int)));
+  ERRMEM (dimension = malloc (m * sizeof(int)));
+  ERRMEM (split = malloc (m * sizeof(int)));
+  ERRMEM (done = malloc (m * sizeof(int)));
+  ERRMEM (lhist = malloc (m * (PRCB_BINS+2) * sizeof(double)));
+  ERRMEM (ghist = malloc (m * (PRCB_BINS+2) * sizeof(double)));
+  ERRMEM (extents = malloc (6 * m * sizeof(REAL)));
+  ERRMEM (lo = malloc (m * sizeof(REAL)));
+  ERRMEM (hi = malloc (m * sizeof(REAL)));
+  ERRMEM (coord = malloc (m * sizeof(REAL)));
+
+  if (ptree[root].dimension >= 0)
+  {
+    level[0] = root;
+    range[0] = 0;
+    range[1] = n;
+    m = 1;
+  }
+  else m = 0;
+
+  corrected = 0;
+
+  while (m > 0)
+  {
+    for (j = 0; j < m; j ++)
+    {
+      dimension[j] = ptree[level[j]].dimension;
+      coord[j] = ptree[level[j]].coord;
+      done[j] = 0;
+    }
+
+    if (!build) /* find skewed nodes; the allreduce uses the histogram buffers */
+    {
+      _dynlb_rcb_partition (m, range, dimension, coord, wpoint, wweight, split);
+
+      for (j = 0; j < m; j ++) /* left subsets */
+      {
+	nrange[2*j] = range[2*j];
+	nrange[2*j+1] = split[j];
+      }
+
+      _dynlb_rcb_weight (m, nrange, wweight, lhist);
+
+      _dynlb_rcb_weight (m, range, wweight, lhist+m);
+
+      MPI_Allreduce (lhist, ghist, 2*m, MPI_DOUBLE, MPI_SUM, comm);
+
+      for (active = j = 0; j < m; j ++)
+      {
+	node = level[j];
+	count = ghist[j];
+	total = ghist[m+j];
+	target = share ? total * share[ptree[node].left] / share[node] : total * (double) leaves[ptree[node].left] / (double) leaves[node];
+
+	if (ABS (count - target) <= tolerance * MIN (target, total - target)) done[j] = 1;
+	else active ++;
+      }
+    }
+    else active = m;
+
+    if (active > 0)
+    {
+      /* global extents of this level's nodes; maxima are negated so that a single MIN reduction suffices */
+      _dynlb_rcb_extents (m, range, wpoint, extents);
+
+      for (j = 0; j < m; j ++)
+      {
+	extents[6*j+3] = -extents[6*j+3];
+	extents[6*j+4] = -extents[6*j+4];
+	extents[6*j+5] = -extents[6*j+5];
+      }
+
+      MPI_Allreduce (MPI_IN_PLACE, extents, 6*m, MPI_REAL, MPI_MIN, comm);
+
+      for (j = 0; j < m; j ++)
+      {
+	REAL *e = &extents[6*j];
+
+	if (build)
+	{
+	  d = 0;
+	  if (-e[4]-e[1] > -e[3]-e[0]) d = 1;
+	  if (-e[5]-e[2] > -e[3+d]-e[d]) d = 2;
+
+	  dimension[j] = d;
+	}
+	else d = dimension[j];
+
+	lo[j] = e[d];
+	hi[j] = -e[3+d];
+
+	if (lo[j] > hi[j]) lo[j] = hi[j] = 0.0; /* empty node */
+      }
+
+      corrected += active;
+    }
+
+    /* narrow down the bin containing the target point count until it is hit or the rounds run out */
+    for (r = 0; r < PRCB_ROUNDS && active > 0; r ++)
+    {
+      _dynlb_rcb_histogram (m, range, dimension, lo, hi, wpoint, wweight, PRCB_BINS, lhist);
+
+      MPI_Allreduce (lhist, ghist, m*(PRCB_BINS+2), MPI_DOUBLE, MPI_SUM, comm);
+
+      for (j = 0; j < m; j ++)
+      {
+	if (done[j]) continue;
+
+	double *h = &ghist[(PRCB_BINS+2)*j];
+
+	for (total = 0.0, l = 0; l < PRCB_BINS+2; l ++) total += h[l];
+
+	node = level[j];
+
+	target = share ? total * share[ptree[node].left] / share[node] : total * (double) leaves[ptree[node].left] / (double) leaves[node];
+
+	for (count = h[0], l = 0; l < PRCB_BINS; l ++) /* count is the number (weight) of points below bin l */
+	{
+	  if (count + h[1+l] > target) break;
+
+	  count += h[1+l];
+	}
+
+	w = (hi[j] - lo[j]) / (REAL) PRCB_BINS;
+	a = lo[j] + (REAL) l * w;
+	b = lo[j] + (REAL) (l+1) * w;
+
+	if (l == PRCB_BINS)
+	{
+	  coord[j] = hi[j];
+	  done[j] = 1;
+	}
+	else if (count == target)
+	{
+	  coord[j] = a;
+	  done[j] = 1;
+	}
+	else if (r == PRCB_ROUNDS-1 || !(a + (b-a)/(REAL)PRCB_BINS > a)) /* out of rounds or precision */
+	{
+	  coord[j] = target - count <= count + h[1+l] - target ? a : b;
+	  done[j] = 1;
+	}
+	else
+	{
+	  lo[j] = a;
+	  hi[j] = b;
+	}
+
+	if (done[j]) active --;
+      }
+    }
+
+    for (j = 0; j < m && write; j ++)
+    {
+      ptree[level[j]].coord = coord[j];
+      ptree[level[j]].dimension = dimension[j];
+    }
+
+    /* split local points and descend */
+    _dynlb_rcb_partition (m, range, dimension, coord, wpoint, wweight, split);
+
+    for (mm = j = 0; j < m; j ++)
+    {
+      node = ptree[level[j]].left;
+
+      if (ptree[node].dimension >= 0)
+      {
+	next[mm] = node;
+	nrange[2*mm] = range[2*j];
+	nrange[2*mm+1] = split[j];
+	mm ++;
+      }
+
+      node = ptree[level[j]].right;
+
+      if (ptree[node].dimension >= 0)
+      {
+	next[mm] = node;
+	nrange[2*mm] = split[j];
+	nrange[2*mm+1] = range[2*j+1];
+	mm ++;
+      }
+    }
+
+    tmp = level; level = next; next = tmp;
+    tmp = range; range = nrange; nrange = tmp;
+    m = mm;
+  }
+
+  _dynlb_aligned_real_free (wpoint[0]);
+  _dynlb_aligned_real_free (wpoint[1]);
+  _dynlb_aligned_real_free (wpoint[2]);
+  if (wweight) _dynlb_aligned_real_free (wweight);
+  free (level);
+  free (next);
+  free (range);
+  free (nrange);
+  free (dimension);
+  free (split);
+  free (done);
+  free (lhist);
+  free (ghist);
+  free (extents);
+  free (lo);
+  free (hi);
+  free (coord);
+
+  return corrected;
+}
+
+/* create rcb partitioning tree on all ranks; bisection coordinates are found
+ * level by level, using a distributed histogram based median search over local points */
+static struct partitioning* prcb_create (MPI_Comm comm, int ntasks, int n, REAL *point[3], REAL *weight, REAL *capacity, int cutoff, int *tree_size, int *leaf_count)
+{
+  struct partitioning *ptree;
+  int gn, i, *leaves;
+  REAL *share = NULL;
+
+  MPI_Allreduce (&n, &gn, 1, MPI_INT, MPI_SUM, comm);
+
+  *tree_size = 1;
+
+  if (cutoff < 0)
+  {
+    prcb_size (-cutoff, 1, tree_size);
+  }
+  else
+  {
+    cutoff = MAX (cutoff, 1); /* 0 would cause trouble */
+
+    prcb_size (gn, cutoff, tree_size);
+  }
+
+  ptree = _dynlb_partitioning_alloc (*tree_size);
+
+  ERRMEM (leaves = malloc (*tree_size * sizeof(int)));
+
+  i = 0;
+
+  if (cutoff < 0)
+  {
+    prcb_init (-cutoff, 1, ptree, 0, &i, leaves);
+  }
+  else
+  {
+    prcb_init (gn, cutoff, ptree, 0, &i, leaves);
+  }
+
+  *leaf_count = leaves[0];
+
+  if (capacity && cutoff < 0) /* ranks are assigned upfront and leaves are sized by their capacity shares */
+  {
+    int size, *leaf_rank;
+
+    MPI_Comm_size (comm, &size);
+
+    ERRMEM (leaf_rank = malloc (*leaf_count * sizeof(int)));
+    ERRMEM (share = malloc (*tree_size * sizeof(REAL)));
+
+    leaf_shares (*leaf_count, size, capacity, leaf_rank, share);
+
+    i = 0;
+
+    set_leaf_ranks (ptree, 0, leaf_rank, &i);
+
+    node_shares (ptree, *tree_size, size, capacity, share);
+
+    free (leaf_rank);
+  }
+
+  prcb_descend (comm, ptree, 0, leaves, share, n, point, weight, 0.0, 1, 1);
+
+  free (leaves);
+  free (share);
+
+  return ptree;
+}
+
+/* correct split coordinates of skewed nodes of an existing rcb tree, keeping its topology; return the number of corrected nodes */
+static int prcb_repair (struct dynlb *lb, int n, REAL *point[3], REAL *weight)
+{
+  struct nodes *nodes = lb->nodes;
+  int *leaves, corrected;
+  REAL *share = NULL;
+
+  ERRMEM (leaves = malloc (lb->ptree_size * sizeof(int)));
+
+  prcb_leaves (lb->ptree, 0, leaves);
+
+  if (lb->capacity)
+  {
+    int size;
+
+    MPI_Comm_size (lb->comm, &size);
+
+    ERRMEM (share = malloc (lb->ptree_size * sizeof(REAL)));
+
+    node_shares (lb->ptree, lb->ptree_size, size, lb->capacity, share);
+  }
+
+  if (nodes && nodes->window != MPI_WIN_NULL) /* node leaders update the shared tree */
+  {
+    corrected = prcb_descend (lb->comm, lb->ptree, 0, leaves, share, n, point, weight, 0.5*lb->epsilon, 0, nodes->leaders != MPI_COMM_NULL);
+
+    MPI_Win_sync (nodes->window);
+    MPI_Barrier (nodes->local);
+    MPI_Win_sync (nodes->window);
+  }
+  else
+  {
+    corrected = prcb_descend (lb->comm, lb->ptree, 0, leaves, share, n, point, weight, 0.5*lb->epsilon, 0, 1);
+  }
+
+  free (leaves);
+  free (share);
+
+  return corrected;
+}
+
+/* find shared memory nodes of a communicator */
+static struct nodes* nodes_create (MPI_Comm comm)
+{
+  int size, rank, lrank, i;
+  struct nodes *nodes;
+
+  MPI_Comm_size (comm, &size);
+  MPI_Comm_rank (comm, &rank);
+
+  ERRMEM (nodes = malloc (sizeof(struct nodes)));
+
+  MPI_Comm_split_type (comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &nodes->local);
+
+  nodes->window = MPI_WIN_NULL;
+  nodes->qwindow = MPI_WIN_NULL;
+
+  MPI_Comm_rank (nodes->local, &lrank);
+
+  MPI_Comm_split (comm, lrank == 0 ? 0 : MPI_UNDEFINED, rank, &nodes->leaders);
+
+  if (lrank == 0)
+  {
+    MPI_Comm_rank (nodes->leaders, &nodes->index);
+    MPI_Comm_size (nodes->leaders, &nodes->count);
+  }
+
+  MPI_Bcast (&nodes->index, 1, MPI_INT, 0, nodes->local);
+  MPI_Bcast (&nodes->count, 1, MPI_INT, 0, nodes->local);
+
+  ERRMEM (nodes->node = malloc (size * sizeof(int)));
+  ERRMEM (nodes->ranks = calloc (nodes->count, sizeof(int)));
+  ERRMEM (nodes->root = malloc (nodes->count * sizeof(int)));
+
+  MPI_Allgather (&nodes->index, 1, MPI_INT, nodes->node, 1, MPI_INT, comm);
+
+  for (i = 0; i < size; i ++) nodes->ranks[nodes->node[i]] ++;
+
+  return nodes;
+}
+
+/* destroy node layout */
+static void nodes_destroy (struct nodes *nodes)
+{
+  if (nodes->leaders != MPI_COMM_NULL) MPI_Comm_free (&nodes->leaders);
+  MPI_Comm_free (&nodes->local);
+  free (nodes->node);
+  free (nodes->ranks);
+  free (nodes->root);
+  free (nodes);
+}
+
+/* initialize hierarchical tree topology: nodes [k0, k1) are bisected first and then ranks of each node */
+static void hrcb_init (struct nodes *nodes, int k0, int k1, struct partitioning *ptree, int node, int *i, int *leaves)
+{
+  if (k1 - k0 > 1)
+  {
+    int k = k0 + (k1-k0)/2;
+
+    ptree[node].coord = 0.0;
+    ptree[node].rank = -1;
+    ptree[node].dimension = 3; /* mark as node; actual dimension 0,1 or 2 will be determined in prcb_descend */
+    ptree[node].left = ++(*i);
+    ptree[node].right = ++(*i);
+    ptree[node].size = -1;
+
+    hrcb_init (nodes, k0, k, ptree, ptree[node].left, i, leaves);
+    hrcb_init (nodes, k, k1, ptree, ptree[node].right, i, leaves);
+
+    leaves[node] = leaves[ptree[node].left] + leaves[ptree[node].right];
+  }
+  else
+  {
+    nodes->root[k0] = node;
+
+    prcb_init (nodes->ranks[k0], 1, ptree, node, i, leaves);
+  }
+}
+
+/* create hierarchical rcb tree on all ranks; one leaf per rank; top levels split the domain among nodes */
+static struct partitioning* hrcb_create (MPI_Comm comm, struct nodes *nodes, int n, REAL *point[3], REAL *weight, REAL *capacity, int *tree_size)
+{
+  struct partitioning *ptree;
+  int size, i, k, r, *leaves, *list;
+  REAL *share = NULL;
+
+  MPI_Comm_size (comm, &size);
+
+  *tree_size = 2*size - 1;
+
+  ptree = _dynlb_partitioning_alloc (*tree_size);
+
+  ERRMEM (leaves = malloc (*tree_size * sizeof(int)));
+
+  i = 0;
+
+  hrcb_init (nodes, 0, nodes->count, ptree, 0, &i, leaves);
+
+  ERRMEM (list = malloc (size * sizeof(int)));
+
+  for (i = k = 0; k < nodes->count; k ++) /* ranks ordered by node */
+  {
+    for (r = 0; r < size; r ++)
+    {
+      if (nodes->node[r] == k) list[i ++] = r;
+    }
+  }
+
+  i = 0;
+
+  set_leaf_ranks (ptree, 0, list, &i);
+
+  if (capacity)
+  {
+    ERRMEM (share = malloc (*tree_size * sizeof(REAL)));
+
+    node_shares (ptree, *tree_size, size, capacity, share);
+  }
+
+  prcb_descend (comm, ptree, 0, leaves, share, n, point, weight, 0.0, 1, 1);
+
+  free (share);
+  free (list);
+  free (leaves);
+
+  return ptree;
+}
+
+/* pack (or unpack) split coordinates of a subtree in depth first order */
+static void subtree_coords (struct partitioning *ptree, int node, REAL *coord, int *i, int pack)
+{
+  if (ptree[node].dimension >= 0)
+  {
+    if (pack) coord[(*i) ++] = ptree[node].coord;
+    else ptree[node].coord = coord[(*i) ++];
+
+    subtree_coords (ptree, ptree[node].left, coord, i, pack);
+    subtree_coords (ptree, ptree[node].right, coord, i, pack);
+  }
+}
+
+/* when only the balance within nodes is violated, correct skewed split planes of every such node's subtree
+ * using node local collectives over points held by the node's ranks; corrected subtrees are then exchanged
+ * among node leaders and broadcast within nodes; nothing is corrected unless the ranks of each such node hold
+ * all points of its region, i.e. points were migrated to their owners, so that prcb_repair is tried instead;
+ * return the number of corrected nodes */
+static int hrcb_repair (struct dynlb *lb, int n, REAL *point[3], REAL *weight, double *rank_load)
+{
+  int size, i, j, k, m, corrected, total, *count, *displ, *leaves, *ranks, *inside;
+  REAL *node_load, *min_load, *max_load, min_node, max_node, *coord, *fpoint[3], *fweight, *share;
+  struct nodes *nodes = lb->nodes;
+  struct partitioning *ptree = lb->ptree;
+
+  MPI_Comm_size (lb->comm, &size);
+
+  ERRMEM (node_load = calloc (nodes->count, sizeof(REAL)));
+  ERRMEM (min_load = malloc (nodes->count * sizeof(REAL)));
+  ERRMEM (max_load = malloc (nodes->count * sizeof(REAL)));
+
+  for (k = 0; k < nodes->count; k ++)
+  {
+    min_load[k] = REAL_MAX;
+    max_load[k] = 0.0;
+  }
+
+  for (i = 0; i < size; i ++)
+  {
+    k = nodes->node[i];
+    node_load[k] += (REAL) rank_load[i];
+    min_load[k] = MIN (min_load[k], (REAL) rank_load[i]);
+    max_load[k] = MAX (max_load[k], (REAL) rank_load[i]);
+  }
+
+  for (min_node = REAL_MAX, max_node = 0.0, k = 0; k < nodes->count; k ++)
+  {
+    node_load[k] /= (REAL) nodes->ranks[k]; /* average load per rank */
+    min_node = MIN (min_node, node_load[k]);
+    max_node = MAX (max_node, node_load[k]);
+  }
+
+  corrected = 0;
+
+  if (!(max_node > (1.0 + lb->epsilon) * min_node)) /* balanced among nodes */
+  {
+    ERRMEM (count = calloc (nodes->count, sizeof(int)));
+    ERRMEM (displ = malloc (nodes->count * sizeof(int)));
+
+    for (total = k = 0; k < nodes->count; k ++)
+    {
+      if (max_load[k] > (1.0 + lb->epsilon) * min_load[k]) /* node subtree needs correction */
+      {
+	count[k] = nodes->ranks[k] - 1; /* internal subtree nodes */
+	corrected ++;
+      }
+
+      displ[k] = total;
+      total += count[k];
+    }
+
+    if (corrected)
+    {
+      ERRMEM (ranks = _dynlb_aligned_int_alloc (MAX(n,1)));
+
+      _dynlb_partitioning_points_assign (lb->ntasks, ptree, n, point, ranks);
+
+      /* points inside each node's region held by any rank, followed by those held by the node's own ranks */
+      ERRMEM (inside = calloc (2*nodes->count, sizeof(int)));
+
+      for (i = 0; i < n; i ++) inside[nodes->node[ranks[i]]] ++;
+
+      inside[nodes->count+nodes->index] = inside[nodes->index];
+
+      MPI_Allreduce (MPI_IN_PLACE, inside, 2*nodes->count, MPI_INT, MPI_SUM, lb->comm);
+
+      for (k = 0; k < nodes->count; k ++)
+      {
+	if (count[k] && inside[k] != inside[nodes->count+k]) corrected = 0; /* points not migrated; node counts would be partial */
+      }
+
+      if (!corrected)
+      {
+	for (k = 0; k < nodes->count; k ++) count[k] = 0;
+      }
+
+      free (inside);
+    }
+    else ranks = NULL;
+
+    if (count[nodes->index])
+    {
+      /* points held by this node's ranks that fall into the node's region */
+      for (m = i = 0; i < n; i ++) m += (nodes->node[ranks[i]] == nodes->index);
+
+      ERRMEM (fpoint[0] = _dynlb_aligned_real_alloc (m));
+      ERRMEM (fpoint[1] = _dynlb_aligned_real_alloc (m));
+      ERRMEM (fpoint[2] = _dynlb_aligned_real_alloc (m));
+
+      if (weight)
+      {
+	ERRMEM (fweight = _dynlb_aligned_real_alloc (m));
+      }
+      else fweight = NULL;
+
+      for (j = i = 0; i < n; i ++)
+      {
+	if (nodes->node[ranks[i]] == nodes->index)
+	{
+	  fpoint[0][j] = point[0][i];
+	  fpoint[1][j] = point[1][i];
+	  fpoint[2][j] = point[2][i];
+	  if (weight) fweight[j] = weight[i];
+	  j ++;
+	}
+      }
+
+      ERRMEM (leaves = malloc (lb->ptree_size * sizeof(int)));
+
+      prcb_leaves (ptree, 0, leaves);
+
+      if (lb->capacity)
+      {
+	ERRMEM (share = malloc (lb->ptree_size * sizeof(REAL)));
+
+	node_shares (ptree, lb->ptree_size, size, lb->capacity, share);
+      }
+      else share = NULL;
+
+      prcb_descend (nodes->local, ptree, nodes->root[nodes->index], leaves, share, m, fpoint, fweight, 0.5*lb->epsilon, 0, 1);
+
+      free (share);
+      free (leaves);
+      _dynlb_aligned_real_free (fpoint[0]);
+      _dynlb_aligned_real_free (fpoint[1]);
+      _dynlb_aligned_real_free (fpoint[2]);
+      if (fweight) _dynlb_aligned_real_free (fweight);
+    }
+
+    if (ranks) _dynlb_aligned_int_free (ranks);
+
+    if (corrected)
+    {
+      ERRMEM (coord = malloc (MAX(total,1) * sizeof(REAL)));
+
+      if (nodes->leaders != MPI_COMM_NULL)
+      {
+	i = 0;
+
+	if (count[nodes->index]) subtree_coords (ptree, nodes->root[nodes->index], coord + displ[nodes->index], &i, 1);
+
+	MPI_Allgatherv (MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, coord, count, displ, MPI_REAL, nodes->leaders);
+      }
+
+      MPI_Bcast (coord, total, MPI_REAL, 0, nodes->local);
+
+      for (k = 0; k < nodes->count; k ++)
+      {
+	if (count[k])
+	{
+	  i = 0;
+
+	  subtree_coords (ptree, nodes->root[k], coord + displ[k], &i, 0);
+	}
+      }
+
+      free (coord);
+    }
+
+    free (count);
+    free (displ);
+  }
+
+  free (node_load);
+  free (min_load);
+  free (max_load);
+
+  return corrected;
+}
+
+/* destroy the query tree and free its node shared window */
+static void query_destroy (struct dynlb *lb)
+{
+  struct nodes *nodes = lb->nodes;
+
+  if (lb->qtree) _dynlb_query_destroy (lb->qtree);
+
+  lb->qtree = NULL;
+
+  if (nodes && nodes->qwindow != MPI_WIN_NULL)
+  {
+    MPI_Win_unlock_all (nodes->qwindow);
+    MPI_Win_free (&nodes->qwindow);
+  }
+}
+
+/* set node boxes of the query tree from merged leaf boxes; a node shared query tree is written by node leaders
+ * once no rank of the node reads it */
+static void query_set_boxes (struct dynlb *lb, REAL *leaf_box)
+{
+  struct nodes *nodes = lb->nodes;
+
+  if (nodes && nodes->qwindow != MPI_WIN_NULL)
+  {
+    MPI_Barrier (nodes->local);
+
+    if (nodes->leaders != MPI_COMM_NULL) _dynlb_query_set_boxes (lb->qtree, leaf_box);
+
+    MPI_Win_sync (nodes->qwindow);
+    MPI_Barrier (nodes->local);
+    MPI_Win_sync (nodes->qwindow);
+  }
+  else _dynlb_query_set_boxes (lb->qtree, leaf_box);
+}
+
+/* pending imbalance reduction */
+struct imbalance
+{
+  MPI_Request request[3];
+  REAL *weight; /* point weights or NULL */
+  REAL *leaf_box; /* leaf boxes of points reduced with DYNLB_LEAF_BOXES, owned by the query tree, or NULL */
+  int *local_size, *rank_size;
+  double *local_load, *rank_load; /* NULL without weights */
+};
+
+/* store local points in the partitioning tree and begin reducing global sizes, and loads when weight is not NULL, per rank */
+static struct imbalance* imbalance_begin (struct dynlb *lb, int n, REAL *point[3], REAL *weight)
+{
+  struct partitioning *ptree = lb->ptree;
+  struct imbalance *imb;
+  int i, size;
+
+  MPI_Comm_size (lb->comm, &size);
+
+  ERRMEM (imb = malloc (sizeof(struct imbalance)));
+
+  imb->weight = weight;
+
+  ERRMEM (imb->local_size = calloc (size, sizeof (int)));
+
+  ERRMEM (imb->rank_size = malloc (size * sizeof (int)));
+
+  if (weight)
+  {
+    ERRMEM (imb->local_load = calloc (size, sizeof (double)));
+
+    ERRMEM (imb->rank_load = malloc (size * sizeof (double)));
+  }
+  else imb->local_load = imb->rank_load = NULL;
+
+  if (weight || (lb->nodes && ((struct nodes*)lb->nodes)->window != MPI_WIN_NULL)) /* shared tree is read only; count assigned ranks instead */
+  {
+    int *ranks;
+
+    ERRMEM (ranks = malloc (MAX(n,1) * sizeof(int)));
+
+    if (lb->qtree) _dynlb_query_points_assign (lb->ntasks, lb->qtree, n, point, ranks);
+    else _dynlb_partitioning_points_assign (lb->ntasks, ptree, n, point, ranks);
+
+    for (i = 0; i < n; i ++) imb->local_size[ranks[i]] ++;
+
+    if (weight) for (i = 0; i < n; i ++) imb->local_load[ranks[i]] += weight[i];
+
+    free (ranks);
+  }
+  else
+  {
+    if (lb->qtree) _dynlb_query_store (lb->ntasks, lb->qtree, ptree, n, point);
+    else _dynlb_partitioning_store (lb->ntasks, ptree, n, point);
+
+    for (i = 0; i < lb->ptree_size; i ++)
+    {
+      if (ptree[i].dimension < 0) /* leaf */
+      {
+	imb->local_size[ptree[i].rank] += ptree[i].size;
+      }
+    }
+  }
+
+  MPI_Iallreduce (imb->local_size, imb->rank_size, size, MPI_INT, MPI_SUM, lb->comm, &imb->request[0]);
+
+  if (weight) MPI_Iallreduce (imb->local_load, imb->rank_load, size, MPI_DOUBLE, MPI_SUM, lb->comm, &imb->request[1]);
+  else imb->request[1] = MPI_REQUEST_NULL;
+
+  if ((lb->flags & DYNLB_LEAF_BOXES) && lb->qtree) /* not while the tree is being built or repaired */
+  {
+    int m = 6 * ((struct query_tree*)lb->qtree)->leaves;
+
+    imb->leaf_box = _dynlb_query_leaf_boxes (lb->ntasks, lb->qtree, n, point);
+
+    MPI_Iallreduce (MPI_IN_PLACE, imb->leaf_box, m, MPI_REAL, MPI_MIN, lb->comm, &imb->request[2]);
+  }
+  else
+  {
+    imb->leaf_box = NULL;
+    imb->request[2] = MPI_REQUEST_NULL;
+  }
+
+  return imb;
+}
+
+/* complete global sizes per rank; update imbalance, lb->npoint, lb->load and optionally output global loads per rank */
+static void imbalance_end (struct dynlb *lb, struct imbalance *imb, double *rank_load_out)
+{
+  int i, rank, size, *rank_size = imb->rank_size;
+  double load, total = 0.0, min_load = REAL_MAX, max_load = 0.0, max_ratio = 0.0;
+
+  MPI_Comm_size (lb->comm, &size);
+  MPI_Comm_rank (lb->comm, &rank);
+
+  MPI_Waitall (3, imb->request, MPI_STATUSES_IGNORE);
+
+  if (imb->leaf_box) query_set_boxes (lb, imb->leaf_box);
+
+  lb->npoint = rank_size[rank];
+
+  for (i = 0; i < size; i ++)
+  {
+    load = imb->rank_load ? imb->rank_load[i] : (double) rank_size[i];
+
+    min_load = MIN (min_load, load);
+    max_load = MAX (max_load, load);
+    total += load;
+
+    if (rank_load_out) rank_load_out[i] = load;
+  }
+
+  lb->load = imb->rank_load ? imb->rank_load[rank] : (double) rank_size[rank];
+
+  if (lb->capacity) /* largest load relative to its capacity target */
+  {
+    for (i = 0; i < size; i ++)
+    {
+      load = imb->rank_load ? imb->rank_load[i] : (double) rank_size[i];
+
+      if (load > 0.0) max_ratio = MAX (max_ratio, load / (total * (double) lb->capacity[i])); /* inf for zero targets */
+    }
+
+    lb->imbalance = total > 0.0 ? max_ratio : 1.0;
+  }
+  else if (lb->policy == DYNLB_COST_POLICY) /* empty ranks do not make it infinite */
+  {
+    lb->imbalance = total > 0.0 ? max_load / (total / (double) size) : 1.0;
+  }
+  else lb->imbalance = max_load/min_load;
+
+  free (imb->local_size);
+  free (imb->rank_size);
+  free (imb->local_load);
+  free (imb->rank_load);
+  free (imb);
+}
+
+/* store local points in the partitioning tree; update imbalance, lb->npoint, lb->load and optionally output global loads per rank */
+static void update_imbalance (struct dynlb *lb, int n, REAL *point[3], REAL *weight, double *rank_load_out)
+{
+  imbalance_end (lb, imbalance_begin (lb, n, point, weight), rank_load_out);
+}
+
+/* is imbalance beyond epsilon */
+static int imbalanced (struct dynlb *lb)
+{
+  return isnan (lb->imbalance) || isinf(lb->imbalance) || lb->imbalance > 1.0 + lb->epsilon;
+}
+
+/* stratified random sample of m out of n indices, one from each of m equal index ranges */
+static void sample_index (int n, int m, int *index, unsigned int seed)
+{
+  int i;
+
+  for (i = 0; i < m; i ++)
+  {
+    seed = seed * 1664525u + 1013904223u; /* linear congruential generator; keeps rand() state of the caller intact */
+
+    index[i] = (int) (((double) i + (double) (seed >> 8) / 16777216.0) * (double) n / (double) m);
+
+    index[i] = MIN (index[i], n-1);
+  }
+}
+
+/* sample points and weights; sample weights are scaled by n/m so that samples stand for all points they were drawn from */
+static void sample_points (int n, REAL *point[3], REAL *weight, int m, REAL *spoint[3], REAL *sweight, unsigned int seed)
+{
+  int i, j, *index;
+
+  ERRMEM (index = malloc (MAX(m,1) * sizeof(int)));
+
+  sample_index (n, m, index, seed);
+
+  for (i = 0; i < m; i ++)
+  {
+    j = index[i];
+    spoint[0][i] = point[0][j];
+    spoint[1][i] = point[1][j];
+    spoint[2][i] = point[2][j];
+    sweight[i] = (weight ? weight[j] : 1.0) * (REAL) n / (REAL) m;
+  }
+
+  free (index);
+}
+
+/* assign ranks to leaves of a tree whose leaf ranks are leaf ordinals, so that contiguous ranges of leaves
+ * have similar weight; leaf weights are summed across ranks */
+static void weighted_ranks (struct dynlb *lb, int n, REAL *point[3], REAL *weight)
+{
+  struct partitioning *ptree = lb->ptree;
+  struct nodes *nodes = lb->nodes;
+  int i, r, size, leaf_count, *ranks, *map, write;
+  double *leaf_weight, total, acc;
+
+  MPI_Comm_size (lb->comm, &size);
+
+  for (leaf_count = i = 0; i < lb->ptree_size; i ++) leaf_count += (ptree[i].dimension < 0);
+
+  ERRMEM (leaf_weight = calloc (leaf_count, sizeof(double)));
+  ERRMEM (ranks = malloc (MAX(n,1) * sizeof(int)));
+  ERRMEM (map = malloc (leaf_count * sizeof(int)));
+
+  _dynlb_partitioning_points_assign (lb->ntasks, ptree, n, point, ranks);
+
+  for (i = 0; i < n; i ++) leaf_weight[ranks[i]] += weight ? weight[i] : 1.0;
+
+  MPI_Allreduce (MPI_IN_PLACE, leaf_weight, leaf_count, MPI_DOUBLE, MPI_SUM, lb->comm);
+
+  for (total = 0.0, i = 0; i < leaf_count; i ++) total += leaf_weight[i];
+
+  for (acc = 0.0, i = 0; i < leaf_count; i ++) /* rank of a leaf is where the middle of its weight falls */
+  {
+    double mid = total > 0.0 ? (acc + 0.5*leaf_weight[i]) / total : ((double) i + 0.5) / (double) leaf_count;
+
+    if (lb->capacity) /* within the capacity prefix */
+    {
+      double cap;
+
+      for (cap = lb->capacity[0], r = 0; r < size-1 && mid > cap; ) cap += lb->capacity[++ r];
+    }
+    else r = mid * (double) size;
+
+    map[i] = MIN (MAX (r, 0), size-1);
+
+    acc += leaf_weight[i];
+  }
+
+  write = !(nodes && nodes->window != MPI_WIN_NULL) || nodes->leaders != MPI_COMM_NULL; /* node leaders update a shared tree */
+
+  for (i = 0; i < lb->ptree_size && write; i ++)
+  {
+    if (ptree[i].dimension < 0) ptree[i].rank = map[ptree[i].rank];
+  }
+
+  if (nodes && nodes->window != MPI_WIN_NULL)
+  {
+    MPI_Win_sync (nodes->window);
+    MPI_Barrier (nodes->local);
+    MPI_Win_sync (nodes->window);
+  }
+
+  free (leaf_weight);
+  free (ranks);
+  free (map);
+}
+
+/* gather morton (or hilbert) codes computed within global extents instead of coordinates and create a radix tree
+ * from them on rank 0; return the tree on rank 0 and NULL elsewhere; leaf ranks are assigned unless
+ * weight is given, points are sampled or hilbert codes are used, in which case they are leaf ordinals in code order
+ * to be replaced by weighted_ranks; when sample > 0 at most sample points per rank are used and refine is set
+ * on rank 0 if some rank holds more; flags select hilbert codes and cubic extents */
+static struct partitioning* radix_codes_create (MPI_Comm comm, int ntasks, int n, REAL *point[3], REAL *weight, int sample,
+  int flags, int cutoff, int *tree_size, int *refine)
+{
+  int size, rank, *vn = NULL, *dn = NULL, gn = 0, i, m, leaf_count, hilbert = flags & DYNLB_HILBERT;
+  uint64_t *code, *gcode = NULL;
+  struct partitioning *ptree = NULL;
+  REAL extents[6], *spoint[3], *sweight, *gweight = NULL;
+  long long total;
+
+  MPI_Comm_size (comm, &size);
+  MPI_Comm_rank (comm, &rank);
+
+  global_extents (comm, ntasks, n, point, extents);
+
+  if (flags & DYNLB_CUBIC_CODES) cubic_extents (extents);
+
+  if (sample > 0) /* codes of sampled points only */
+  {
+    m = MIN (n, sample);
+
+    ERRMEM (spoint[0] = _dynlb_aligned_real_alloc (m));
+    ERRMEM (spoint[1] = _dynlb_aligned_real_alloc (m));
+    ERRMEM (spoint[2] = _dynlb_aligned_real_alloc (m));
+    ERRMEM (sweight = _dynlb_aligned_real_alloc (m));
+
+    sample_points (n, point, weight, m, spoint, sweight, rank+1);
+  }
+  else
+  {
+    m = n;
+    spoint[0] = point[0];
+    spoint[1] = point[1];
+    spoint[2] = point[2];
+    sweight = weight;
+  }
+
+  ERRMEM (code = _dynlb_aligned_uint64_alloc (m));
+
+  if (hilbert) _dynlb_hilbert_codes (ntasks, m, spoint, extents, code);
+  else _dynlb_morton_codes (ntasks, m, spoint, extents, code);
+
+  if (rank == 0)
+  {
+    ERRMEM (vn = malloc (size * sizeof(int)));
+  }
+
+  MPI_Gather (&n, 1, MPI_INT, vn, 1, MPI_INT, 0, comm);
+
+  if (rank == 0)
+  {
+    ERRMEM (dn = malloc (size * sizeof(int)));
+
+    for (*refine = 0, total = gn = i = 0; i < size; i ++)
+    {
+      total += vn[i];
+
+      if (sample > 0) /* gathered sample sizes */
+      {
+	*refine |= (vn[i] > sample);
+	vn[i] = MIN (vn[i], sample);
+      }
+
+      dn[i] = gn;
+      gn += vn[i];
+    }
+
+    ERRMEM (gcode = _dynlb_aligned_uint64_alloc (gn));
+
+    if (sweight)
+    {
+      ERRMEM (gweight = _dynlb_aligned_real_alloc (gn));
+    }
+  }
+
+  MPI_Gatherv (code, m, MPI_UINT64_T, gcode, vn, dn, MPI_UINT64_T, 0, comm);
+
+  if (sweight) MPI_Gatherv (sweight, m, MPI_REAL, gweight, vn, dn, MPI_REAL, 0, comm);
+
+  if (rank == 0)
+  {
+    if (cutoff <= 0)
+    {
+      cutoff = gn/size/64; /* same default as for gathered coordinates */
+    }
+    else if (sample > 0 && total > 0) /* leaf sizes are given in points */
+    {
+      cutoff = MAX (1, (long long) cutoff * gn / total);
+    }
+
+    ptree = _dynlb_partitioning_create_radix_codes (ntasks, gn, gcode, gweight, extents, hilbert, cutoff, tree_size, &leaf_count);
+
+    if (sweight && !hilbert) _dynlb_partitioning_assign_ranks (ptree, 1, 0); /* leaf ordinals */
+    else if (!hilbert) _dynlb_partitioning_assign_ranks (ptree, leaf_count / size, leaf_count % size);
+
+    if (gweight) _dynlb_aligned_real_free (gweight);
+    _dynlb_aligned_uint64_free (gcode);
+    free (dn);
+    free (vn);
+  }
+
+  if (sample > 0)
+  {
+    _dynlb_aligned_real_free (spoint[0]);
+    _dynlb_aligned_real_free (spoint[1]);
+    _dynlb_aligned_real_free (spoint[2]);
+    _dynlb_aligned_real_free (sweight);
+  }
+
+  _dynlb_aligned_uint64_free (code);
+
+  return ptree;
+}
+
+struct wire /* last broadcast tree in depth first order; trees of the same shape are then sent as differences */
+{
+  int size, leaf_count, ranks;
+  signed char *dim;
+  REAL *coord;
+};
+
+enum wire_ranks /* how receivers derive leaf ranks */
+{
+  WIRE_UNIFORM, /* leaf_count/size leaves per rank, one more for the first leaf_count%size ranks */
+  WIRE_ORDINALS, /* leaf ordinals */
+  WIRE_EXPLICIT /* sent along with leaves */
+};
+
+#define WIRE_CHUNK 65536 /* bytes per pipelined broadcast chunk */
+
+/* depth first order of tree nodes */
+static void wire_order (struct partitioning *ptree, int node, int *order, int *i)
+{
+  order[(*i) ++] = node;
+
+  if (ptree[node].dimension >= 0)
+  {
+    wire_order (ptree, ptree[node].left, order, i);
+    wire_order (ptree, ptree[node].right, order, i);
+  }
+}
+
+/* set node i of a depth first ordered tree and link it with its parent; stack holds internal nodes awaiting children */
+static void wire_node (struct partitioning *ptree, int i, int dim, REAL coord, int rank, int *stack, int *top)
+{
+  int p;
+
+  if (*top > 0)
+  {
+    p = stack[*top-1];
+
+    if (ptree[p].left < 0) ptree[p].left = i;
+    else
+    {
+      ptree[p].right = i;
+      (*top) --;
+    }
+  }
+
+  ptree[i].coord = dim >= 0 ? coord : 0.0;
+  ptree[i].dimension = dim;
+  ptree[i].left = ptree[i].right = -1;
+  ptree[i].rank = rank;
+  ptree[i].size = 0; /* recomputed by receivers when needed */
+
+  if (dim >= 0) stack[(*top) ++] = i;
+}
+
+/* encode tree_size nodes of ptree into a wire buffer; a whole tree is a sequence of depth first ordered records
+ * {dimension byte, coordinate of internal nodes, rank of leaves when WIRE_EXPLICIT}; a tree of the same shape and
+ * rank derivation as the previous one is sent as {index, dimension, coordinate} records of changed nodes instead */
+static char* wire_encode (struct wire *prev, int size, struct partitioning *ptree, int tree_size, int header[5])
+{
+  int i, j, l, r, leaf_count, ranks, delta, bytes, records, *order;
+  char *buf, *pos;
+
+  ERRMEM (order = malloc (tree_size * sizeof(int)));
+
+  i = 0;
+
+  wire_order (ptree, 0, order, &i);
+
+  for (leaf_count = i = 0; i < tree_size; i ++) leaf_count += (ptree[i].dimension < 0);
+
+  for (ranks = WIRE_UNIFORM, l = r = j = i = 0; i < tree_size; i ++) /* uniform rank assignment in leaf order */
+  {
+    if (ptree[order[i]].dimension < 0)
+    {
+      if (ptree[order[i]].rank != r) ranks = WIRE_EXPLICIT;
+
+      if (++ l == leaf_count / size + (r < leaf_count % size))
+      {
+	l = 0;
+	r ++;
+      }
+    }
+  }
+
+  if (ranks == WIRE_EXPLICIT)
+  {
+    for (ranks = WIRE_ORDINALS, j = i = 0; i < tree_size; i ++)
+    {
+      if (ptree[order[i]].dimension < 0 && ptree[order[i]].rank != j ++) ranks = WIRE_EXPLICIT;
+    }
+  }
+
+  delta = prev && prev->size == tree_size && prev->leaf_count == leaf_count && prev->ranks == ranks && ranks != WIRE_EXPLICIT;
+
+  for (records = i = 0; i < tree_size && delta; i ++)
+  {
+    struct partitioning *node = &ptree[order[i]];
+
+    if ((node->dimension < 0) != (prev->dim[i] < 0)) delta = 0; /* different shape */
+    else if (node->dimension >= 0 && (node->dimension != prev->dim[i] || node->coord != prev->coord[i])) records ++;
+  }
+
+  for (bytes = i = 0; i < tree_size; i ++)
+  {
+    bytes += 1 + (ptree[order[i]].dimension >= 0 ? sizeof(REAL) : (ranks == WIRE_EXPLICIT ? sizeof(int) : 0));
+  }
+
+  if (delta && records * (sizeof(int) + 1 + sizeof(REAL)) >= bytes) delta = 0; /* not worth it */
+
+  if (delta) bytes = records * (sizeof(int) + 1 + sizeof(REAL));
+  else records = 0;
+
+  ERRMEM (buf = malloc (MAX(bytes,1)));
+
+  for (pos = buf, i = 0; i < tree_size; i ++)
+  {
+    struct partitioning *node = &ptree[order[i]];
+    signed char dim = node->dimension < 0 ? -1 : node->dimension;
+
+    if (delta)
+    {
+      if (dim >= 0 && (dim != prev->dim[i] || node->coord != prev->coord[i]))
+      {
+	memcpy (pos, &i, sizeof(int)); pos += sizeof(int);
+	*pos = dim; pos ++;
+	memcpy (pos, &node->coord, sizeof(REAL)); pos += sizeof(REAL);
+      }
+    }
+    else
+    {
+      *pos = dim; pos ++;
+
+      if (dim >= 0)
+      {
+	memcpy (pos, &node->coord, sizeof(REAL));
+	pos += sizeof(REAL);
+      }
+      else if (ranks == WIRE_EXPLICIT)
+      {
+	memcpy (pos, &node->rank, sizeof(int));
+	pos += sizeof(int);
+      }
+    }
+  }
+
+  header[0] = delta;
+  header[1] = bytes;
+  header[2] = leaf_count;
+  header[3] = ranks;
+  header[4] = records;
+
+  free (order);
+
+  return buf;
+}
+
+/* broadcast tree_size nodes of ptree, given on rank 0 of comm, into out[] on all ranks of comm, including rank 0,
+ * in depth first order; the wire buffer is broadcast in chunks and whole trees are decoded as chunks arrive */
+static void wire_bcast (struct dynlb *lb, MPI_Comm comm, struct partitioning *ptree, struct partitioning *out, int tree_size)
+{
+  struct wire *prev = lb->wire, *next;
+  int size, rank, header[5], chunks, avail, i, k, top, rnk, *stack;
+  MPI_Request *request;
+  signed char dim;
+  REAL coord;
+  char *buf, *pos;
+
+  MPI_Comm_size (lb->comm, &size); /* leaf ranks are ranks of lb->comm */
+  MPI_Comm_rank (comm, &rank);
+
+  if (rank == 0) buf = wire_encode (prev, size, ptree, tree_size, header);
+
+  MPI_Bcast (header, 5, MPI_INT, 0, comm);
+
+  if (rank != 0)
+  {
+    ERRMEM (buf = malloc (MAX(header[1],1)));
+  }
+
+  chunks = (header[1] + WIRE_CHUNK - 1) / WIRE_CHUNK;
+
+  ERRMEM (request = malloc (MAX(chunks,1) * sizeof(MPI_Request)));
+
+  for (k = 0; k < chunks; k ++)
+  {
+    MPI_Ibcast (buf + k*WIRE_CHUNK, MIN (WIRE_CHUNK, header[1] - k*WIRE_CHUNK), MPI_BYTE, 0, comm, &request[k]);
+  }
+
+  ERRMEM (stack = malloc (tree_size * sizeof(int)));
+
+  top = 0;
+
+  if (header[0]) /* apply changed nodes to the previous tree */
+  {
+    next = prev;
+
+    MPI_Waitall (chunks, request, MPI_STATUSES_IGNORE);
+
+    for (pos = buf, k = 0; k < header[4]; k ++)
+    {
+      memcpy (&i, pos, sizeof(int)); pos += sizeof(int);
+      next->dim[i] = *pos; pos ++;
+      memcpy (&next->coord[i], pos, sizeof(REAL)); pos += sizeof(REAL);
+    }
+
+    for (i = 0; i < tree_size; i ++) wire_node (out, i, next->dim[i], next->coord[i], -1, stack, &top);
+  }
+  else /* decode whole records as chunks arrive */
+  {
+    if (prev)
+    {
+      free (prev->dim);
+      free (prev->coord);
+      free (prev);
+    }
+
+    ERRMEM (next = malloc (sizeof(struct wire)));
+    ERRMEM (next->dim = malloc (tree_size));
+    ERRMEM (next->coord = malloc (tree_size * sizeof(REAL)));
+
+    for (pos = buf, i = k = 0; k < chunks; k ++)
+    {
+      MPI_Wait (&request[k], MPI_STATUS_IGNORE);
+
+      avail = MIN ((k+1)*WIRE_CHUNK, header[1]);
+
+      while (i < tree_size && pos - buf < avail)
+      {
+	dim = *pos;
+
+	if ((int) (pos - buf) + 1 + (int) (dim >= 0 ? sizeof(REAL) : (header[3] == WIRE_EXPLICIT ? sizeof(int) : 0)) > avail) break; /* partial record */
+
+	pos ++;
+	coord = 0.0;
+	rnk = -1;
+
+	if (dim >= 0)
+	{
+	  memcpy (&coord, pos, sizeof(REAL));
+	  pos += sizeof(REAL);
+	}
+	else if (header[3] == WIRE_EXPLICIT)
+	{
+	  memcpy (&rnk, pos, sizeof(int));
+	  pos += sizeof(int);
+	}
+
+	next->dim[i] = dim;
+	next->coord[i] = coord;
+
+	wire_node (out, i ++, dim, coord, rnk, stack, &top);
+      }
+    }
+  }
+
+  next->size = tree_size;
+  next->leaf_count = header[2];
+  next->ranks = header[3];
+
+  lb->wire = next;
+
+  if (header[3] == WIRE_UNIFORM) _dynlb_partitioning_assign_ranks (out, header[2] / size, header[2] % size);
+  else if (header[3] == WIRE_ORDINALS) _dynlb_partitioning_assign_ranks (out, 1, 0);
+
+  free (stack);
+  free (request);
+  free (buf);
+}
+
+/* broadcast the partitioning tree from rank 0 into a shared memory window of each node; only node leaders receive it */
+static struct partitioning* shared_tree_bcast (struct dynlb *lb, struct partitioning *ptree, int tree_size)
+{
+  struct nodes *nodes = lb->nodes;
+  MPI_Aint bytes = nodes->leaders != MPI_COMM_NULL ? tree_size*sizeof(struct partitioning) : 0;
+  struct partitioning *base;
+  int disp;
+
+  MPI_Win_allocate_shared (bytes, 1, MPI_INFO_NULL, nodes->local, &base, &nodes->window);
+
+  MPI_Win_lock_all (MPI_MODE_NOCHECK, nodes->window); /* passive epoch open for the lifetime of the tree */
+
+  MPI_Win_shared_query (nodes->window, 0, &bytes, &disp, &base); /* leader's segment */
+
+  if (nodes->leaders != MPI_COMM_NULL) /* rank 0 is the first leader */
+  {
+    wire_bcast (lb, nodes->leaders, ptree, base, tree_size);
+  }
+
+  MPI_Win_sync (nodes->window);
+  MPI_Barrier (nodes->local);
+  MPI_Win_sync (nodes->window);
+
+  return base;
+}
+
+/* broadcast partitioning tree of size lb->ptree_size from rank 0, where ptree is given, and set lb->ptree */
+static void tree_bcast (struct dynlb *lb, struct partitioning *ptree)
+{
+  int rank;
+
+  MPI_Comm_rank (lb->comm, &rank);
+
+  if (lb->flags & DYNLB_SHARED_TREE) /* one copy per node */
+  {
+    lb->ptree = shared_tree_bcast (lb, rank == 0 ? ptree : NULL, lb->ptree_size);
+  }
+  else
+  {
+    lb->ptree = _dynlb_partitioning_alloc (lb->ptree_size);
+
+    wire_bcast (lb, lb->comm, rank == 0 ? ptree : NULL, lb->ptree, lb->ptree_size);
+  }
+
+  if (rank == 0) _dynlb_partitioning_destroy (ptree);
+}
+
+/* destroy partitioning tree */
+static void tree_destroy (struct dynlb *lb)
+{
+  struct nodes *nodes = lb->nodes;
+
+  if (nodes && nodes->window != MPI_WIN_NULL)
+  {
+    MPI_Win_unlock_all (nodes->window);
+    MPI_Win_free (&nodes->window);
+  }
+  else
+  {
+    _dynlb_partitioning_destroy (lb->ptree);
+  }
+}
+
+/* compile the query tree of the current partitioning tree, find the regions of ranks and bound leaf points
+ * with DYNLB_LEAF_BOXES; called after any tree change; with a node shared partitioning tree node leaders compile
+ * the query tree into a shared memory window of each node, which all ranks of the node read in place */
+static void tree_compile (struct dynlb *lb, int n, REAL *point[3])
+{
+  struct nodes *nodes = lb->nodes;
+  struct query_tree *qtree;
+  REAL *leaf_box;
+  int size;
+
+  MPI_Comm_size (lb->comm, &size);
+
+  query_destroy (lb);
+
+  if (nodes && nodes->window != MPI_WIN_NULL)
+  {
+    MPI_Aint bytes = 0;
+    char *base;
+    int disp;
+
+    qtree = NULL;
+
+    if (nodes->leaders != MPI_COMM_NULL)
+    {
+      qtree = _dynlb_query_create (lb->ptree, lb->ptree_size, lb->flags & DYNLB_WIDE_TREE);
+
+      _dynlb_query_regions (qtree, size);
+
+      bytes = _dynlb_query_shared_bytes (qtree, size, lb->flags & DYNLB_LEAF_BOXES);
+    }
+
+    MPI_Win_allocate_shared (bytes, 1, MPI_INFO_NULL, nodes->local, &base, &nodes->qwindow);
+
+    MPI_Win_lock_all (MPI_MODE_NOCHECK, nodes->qwindow); /* passive epoch open for the lifetime of the query tree */
+
+    MPI_Win_shared_query (nodes->qwindow, 0, &bytes, &disp, &base); /* leader's segment */
+
+    if (qtree)
+    {
+      _dynlb_query_share (qtree, size, lb->flags & DYNLB_LEAF_BOXES, (int8_t*) base);
+
+      _dynlb_query_destroy (qtree);
+    }
+
+    MPI_Win_sync (nodes->qwindow);
+    MPI_Barrier (nodes->local);
+    MPI_Win_sync (nodes->qwindow);
+
+    lb->qtree = qtree = _dynlb_query_attach ((int8_t*) base);
+  }
+  else
+  {
+    lb->qtree = qtree = _dynlb_query_create (lb->ptree, lb->ptree_size, lb->flags & DYNLB_WIDE_TREE);
+
+    _dynlb_query_regions (qtree, size);
+  }
+
+  if (lb->flags & DYNLB_LEAF_BOXES)
+  {
+    leaf_box = _dynlb_query_leaf_boxes (lb->ntasks, qtree, n, point);
+
+    MPI_Allreduce (MPI_IN_PLACE, leaf_box, 6 * qtree->leaves, MPI_REAL, MPI_MIN, lb->comm);
+
+    query_set_boxes (lb, leaf_box);
+  }
+}
+
+/* build partitioning tree of lb->part type and set lb->ptree, lb->ptree_size, lb->imbalance, lb->npoint and lb->load;
+ * weight is NULL or given on all ranks; gathered trees are built from lb->sample points per rank with DYNLB_SAMPLE_TREE;
+ * return 1 when some rank holds more points than sampled, so that more samples could improve the tree */
+static int tree_build_sampled (struct dynlb *lb, int n, REAL *point[3], REAL *weight)
+{
+  int size, rank, *vn, *dn, gn, i, *rank_size, cutoff = lb->cutoff;
+  struct partitioning *ptree;
+  MPI_Comm comm = lb->comm;
+  REAL *gpoint[3], *gweight = NULL, *share = NULL, *spoint[3], *sweight, extents[6];
+  int leaf_count, *leaf_rank = NULL, upfront, ordinals, sample, m, refine = 0;
+  int hilbert = lb->part == DYNLB_RADIX_TREE && (lb->flags & DYNLB_HILBERT);
+  long long total;
+
+  MPI_Comm_size (comm, &size);
+  MPI_Comm_rank (comm, &rank);
+
+  if (lb->part == DYNLB_PRCB_TREE) /* built on all ranks; no gathering and broadcasting needed */
+  {
+    if (cutoff <= 0)
+    {
+      cutoff = -size; /* as many leaves as ranks by default */
+    }
+
+    lb->ptree = prcb_create (comm, lb->ntasks, n, point, weight, lb->capacity, cutoff, &lb->ptree_size, &leaf_count);
+
+    if (!(lb->capacity && cutoff < 0)) /* otherwise ranks were assigned by prcb_create */
+    {
+      if (weight || lb->capacity)
+      {
+	_dynlb_partitioning_assign_ranks (lb->ptree, 1, 0); /* leaf ordinals */
+
+	weighted_ranks (lb, n, point, weight);
+      }
+      else _dynlb_partitioning_assign_ranks (lb->ptree, leaf_count / size, leaf_count % size);
+    }
+
+    update_imbalance (lb, n, point, weight, NULL);
+
+    if (isnan(lb->imbalance)) lb->imbalance = (REAL)1/(REAL)0; /* inf istead */
+
+    return 0;
+  }
+
+  if (lb->part == DYNLB_RADIX_TREE && (lb->flags & DYNLB_MORTON_CODES)) /* only codes are gathered; sizes are stored on all ranks */
+  {
+    sample = (lb->flags & DYNLB_SAMPLE_TREE) ? lb->sample : 0;
+
+    ptree = radix_codes_create (comm, lb->ntasks, n, point, weight, sample, lb->flags, cutoff, &lb->ptree_size, &refine);
+
+    MPI_Bcast (&lb->ptree_size, 1, MPI_INT, 0, comm);
+
+    tree_bcast (lb, ptree);
+
+    if (weight || lb->capacity || sample || hilbert) weighted_ranks (lb, n, point, weight);
+
+    update_imbalance (lb, n, point, weight, NULL);
+
+    if (isnan(lb->imbalance)) lb->imbalance = (REAL)1/(REAL)0; /* inf istead */
+
+    if (sample) MPI_Bcast (&refine, 1, MPI_INT, 0, comm);
+
+    return refine;
+  }
+
+  if (lb->part == DYNLB_HRCB_TREE) /* built on all ranks, one leaf per rank; nodes are split first */
+  {
+    lb->ptree = hrcb_create (comm, lb->nodes, n, point, weight, lb->capacity, &lb->ptree_size);
+
+    update_imbalance (lb, n, point, weight, NULL);
+
+    if (isnan(lb->imbalance)) lb->imbalance = (REAL)1/(REAL)0; /* inf istead */
+
+    return 0;
+  }
+
+  upfront = lb->capacity && (lb->part == DYNLB_RCB_TREE || lb->part == DYNLB_MJ_TREE) && cutoff <= 0; /* ranks assigned before splitting */
+
+  sample = (lb->flags & DYNLB_SAMPLE_TREE) ? lb->sample : 0;
+
+  ordinals = !upfront && (weight || lb->capacity || sample || hilbert); /* leaf ranks are ordinals until weighted_ranks */
+
+  if (sample) /* gather samples instead of all points */
+  {
+    m = MIN (n, sample);
+
+    ERRMEM (spoint[0] = _dynlb_aligned_real_alloc (m));
+    ERRMEM (spoint[1] = _dynlb_aligned_real_alloc (m));
+    ERRMEM (spoint[2] = _dynlb_aligned_real_alloc (m));
+    ERRMEM (sweight = _dynlb_aligned_real_alloc (m));
+
+    sample_points (n, point, weight, m, spoint, sweight, rank+1);
+  }
+  else
+  {
+    m = n;
+    spoint[0] = point[0];
+    spoint[1] = point[1];
+    spoint[2] = point[2];
+    sweight = weight;
+  }
+
+  if (rank == 0)
+  {
+    ERRMEM (vn = malloc (size * sizeof(int)));
+  }
+  else
+  {
+    vn = NULL;
+  }
+
+  MPI_Gather (&n, 1, MPI_INT, vn, 1, MPI_INT, 0, comm);
+
+  if (rank == 0)
+  {
+
+    ERRMEM (dn = malloc (size * sizeof(int)));
+
+    for (total = gn = i = 0; i < size; i ++)
+    {
+      total += vn[i];
+
+      if (sample) /* gathered sample sizes */
+      {
+	refine |= (vn[i] > sample);
+	vn[i] = MIN (vn[i], sample);
+      }
+
+      dn[i] = gn;
+      gn += vn[i];
+    }
+
+    ERRMEM (gpoint[0] = _dynlb_aligned_real_alloc (gn));
+    ERRMEM (gpoint[1] = _dynlb_aligned_real_alloc (gn));
+    ERRMEM (gpoint[2] = _dynlb_aligned_real_alloc (gn));
+
+    if (sweight)
+    {
+      ERRMEM (gweight = _dynlb_aligned_real_alloc (gn));
+    }
+  }
+
+  MPI_Gatherv (spoint[0], m, MPI_REAL, gpoint[0], vn, dn, MPI_REAL, 0, comm);
+  MPI_Gatherv (spoint[1], m, MPI_REAL, gpoint[1], vn, dn, MPI_REAL, 0, comm);
+  MPI_Gatherv (spoint[2], m, MPI_REAL, gpoint[2], vn, dn, MPI_REAL, 0, comm);
+
+  if (sweight) MPI_Gatherv (sweight, m, MPI_REAL, gweight, vn, dn, MPI_REAL, 0, comm);
+
+  if (sample)
+  {
+    _dynlb_aligned_real_free (spoint[0]);
+    _dynlb_aligned_real_free (spoint[1]);
+    _dynlb_aligned_real_free (spoint[2]);
+    _dynlb_aligned_real_free (sweight);
+  }
+
+  ERRMEM (rank_size = calloc (size, sizeof (int)));
+
+  if (rank == 0)
+  {
+    switch (lb->part)
+    {
+    case DYNLB_RADIX_TREE:
+
+      if (cutoff <= 0)
+      {
+	cutoff = gn/size/64; /* more than 64 drives initial imbalance down while increasing local tree size */
+      }
+      else if (sample && total > 0) /* leaf sizes are given in points */
+      {
+	cutoff = MAX (1, (long long) cutoff * gn / total);
+      }
+
+      if (lb->flags & DYNLB_CUBIC_CODES)
+      {
+	_dynlb_extents_of_points (lb->ntasks, gn, gpoint, extents);
+
+	cubic_extents (extents);
+      }
+
+      ptree = _dynlb_partitioning_create_radix (lb->ntasks, gn, gpoint, gweight, (lb->flags & DYNLB_CUBIC_CODES) ? extents : NULL,
+	hilbert, cutoff, &lb->ptree_size, &leaf_count);
+
+      break;
+    case DYNLB_RCB_TREE:
+    case DYNLB_MJ_TREE:
+
+      if (cutoff <= 0)
+      {
+	cutoff = -size; /* as many leaves as ranks by default */
+      }
+      else if (sample && total > 0) /* leaf sizes are given in points */
+      {
+	cutoff = MAX (1, (long long) cutoff * gn / total);
+      }
+
+      if (upfront) /* leaves sized by capacity shares of their upfront assigned ranks */
+      {
+	ERRMEM (leaf_rank = malloc (-cutoff * sizeof(int)));
+	ERRMEM (share = malloc (-cutoff * sizeof(REAL)));
+
+	leaf_shares (-cutoff, size, lb->capacity, leaf_rank, share);
+      }
+
+      if (lb->part == DYNLB_MJ_TREE) ptree = _dynlb_partitioning_create_mj (lb->ntasks, gn, gpoint, gweight, share, cutoff, &lb->ptree_size, &leaf_count);
+      else ptree = _dynlb_partitioning_create_rcb (lb->ntasks, gn, gpoint, gweight, share, cutoff, &lb->ptree_size, &leaf_count);
+
+      break;
+    }
+
+    if (upfront)
+    {
+      i = 0;
+
+      set_leaf_ranks (ptree, 0, leaf_rank, &i);
+    }
+    else if (!ordinals) _dynlb_partitioning_assign_ranks (ptree, leaf_count / size, leaf_count % size);
+    else if (!hilbert) _dynlb_partitioning_assign_ranks (ptree, 1, 0); /* leaf ordinals; see weighted_ranks below */
+    /* else leaf ordinals in hilbert code order were set by the radix tree builder */
+
+    _dynlb_partitioning_store (lb->ntasks, ptree, gn, gpoint);
+
+#if 0
+    printf ("Leaf count: %d\n", leaf_count);
+
+    printf ("Leaf ranks: ");
+    for (i = 0; i < lb->ptree_size; i ++)
+    {
+      if (ptree[i].dimension < 0) /* leaf */
+      {
+	printf ("%d ", ptree[i].rank);
+      }
+    }
+    printf ("\n");
+
+    printf ("Leaf sizes: ");
+    for (i = 0; i < lb->ptree_size; i ++)
+    {
+      if (ptree[i].dimension < 0) /* leaf */
+      {
+	printf ("%d ", ptree[i].size);
+      }
+    }
+    printf ("\n");
+#endif
+
+    /* determine initial imbalance; recomputed by update_imbalance below when leaf ranks are ordinals */
+
+    for (i = 0; i < lb->ptree_size && !ordinals; i ++)
+    {
+      if (ptree[i].dimension < 0) /* leaf */
+      {
+	rank_size[ptree[i].rank] += ptree[i].size;
+      }
+    }
+
+    int min_size = INT_MAX, max_size = 0;
+
+    for (i = 0; i < size; i ++)
+    {
+      min_size = MIN (min_size, rank_size[i]);
+      max_size = MAX (max_size, rank_size[i]);
+    }
+
+    lb->imbalance = (REAL)max_size/(REAL)min_size;
+
+    if (isnan(lb->imbalance)) lb->imbalance = (REAL)1/(REAL)0; /* inf istead */
+  }
+
+  /* broadcast ptree_size and initial imbalance */
+  MPI_Bcast (&lb->ptree_size, 1, MPI_INT, 0, comm);
+  MPI_Bcast (&lb->imbalance, 1, MPI_REAL, 0, comm);
+
+  /* broadcast rank_size and update lb->npoint */
+  MPI_Bcast (rank_size, size, MPI_INT, 0, comm);
+
+  lb->npoint = rank_size[rank];
+
+  lb->load = lb->npoint;
+
+  tree_bcast (lb, ptree);
+
+  if (ordinals || upfront) /* ranks, imbalance and loads follow weights, capacities, all sampled points and hilbert order */
+  {
+    if (!upfront) weighted_ranks (lb, n, point, weight);
+
+    update_imbalance (lb, n, point, weight, NULL);
+
+    if (isnan(lb->imbalance)) lb->imbalance = (REAL)1/(REAL)0; /* inf istead */
+  }
+
+  if (rank == 0)
+  {
+    _dynlb_aligned_real_free (gpoint[0]);
+    _dynlb_aligned_real_free (gpoint[1]);
+    _dynlb_aligned_real_free (gpoint[2]);
+    if (gweight) _dynlb_aligned_real_free (gweight);
+    free (leaf_rank);
+    free (share);
+    free (dn);
+    free (vn);
+  }
+
+  free (rank_size);
+
+  if (sample) MPI_Bcast (&refine, 1, MPI_INT, 0, comm);
+
+  return refine;
+}
+
+/* build partitioning tree; with DYNLB_SAMPLE_TREE the sample size is doubled and the tree rebuilt while imbalance
+ * exceeds epsilon and some rank holds more points than sampled, up to the largest number of points per rank */
+static void tree_build (struct dynlb *lb, int n, REAL *point[3], REAL *weight)
+{
+  int nmax = 0;
+
+  if (lb->flags & DYNLB_SAMPLE_TREE)
+  {
+    MPI_Allreduce (&n, &nmax, 1, MPI_INT, MPI_MAX, lb->comm);
+
+    lb->sample = MAX (1, MIN (lb->sample, nmax));
+  }
+
+  while (tree_build_sampled (lb, n, point, weight) && imbalanced (lb) && lb->sample < nmax) /* more samples */
+  {
+    lb->sample = MIN (2*lb->sample, nmax);
+
+    tree_destroy (lb);
+  }
+}
+
+struct overlap /* number of points, currently held by a rank, that fall into the partition of a new rank label */
+{
+  int label, rank, count;
+};
+
+/* larger overlaps first */
+static int overlap_compare (const void *a, const void *b)
+{
+  const struct overlap *x = a, *y = b;
+
+  if (x->count != y->count) return x->count > y->count ? -1 : 1;
+  if (x->label != y->label) return x->label - y->label;
+  return x->rank - y->rank;
+}
+
+/* can the partition labeled 'label' be given to 'rank' instead; hierarchical trees keep labels within nodes and
+ * partitions sized for capacities keep labels among ranks of equal capacity */
+static int relabel_allowed (struct dynlb *lb, int label, int rank)
+{
+  struct nodes *nodes = lb->nodes;
+
+  if (lb->part == DYNLB_HRCB_TREE && nodes->node[label] != nodes->node[rank]) return 0;
+
+  if (lb->capacity && lb->capacity[label] != lb->capacity[rank]) return 0;
+
+  return 1;
+}
+
+/* relabel leaf ranks of a freshly built tree so that ranks keep as many of their current points as possible: sparse
+ * overlaps of current ranks with new partitions are gathered on rank 0 and matched greedily by decreasing size;
+ * set lb->nmigrate to the resulting number of points that will migrate */
+static void relabel_ranks (struct dynlb *lb, int n, REAL *point[3])
+{
+  struct partitioning *ptree = lb->ptree;
+  struct nodes *nodes = lb->nodes;
+  int size, rank, i, j, m, r, gm, kept, npoint, write, *ranks, *count, *pair, *gpair, *vn, *dn, *perm, *taken;
+  struct overlap *entry;
+  double local[2], *all;
 
-  MPI_Comm_size (MPI_COMM_WORLD, &size);
-  MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+  MPI_Comm_size (lb->comm, &size);
+  MPI_Comm_rank (lb->comm, &rank);
+
+  ERRMEM (ranks = malloc (MAX(n,1) * sizeof(int)));
+  ERRMEM (count = calloc (size, sizeof(int)));
+
+  _dynlb_partitioning_points_assign (lb->ntasks, ptree, n, point, ranks);
+
+  for (i = 0; i < n; i ++) count[ranks[i]] ++;
+
+  for (m = i = 0; i < size; i ++) m += (count[i] > 0);
+
+  ERRMEM (pair = malloc (MAX(2*m,1) * sizeof(int)));
+
+  for (j = i = 0; i < size; i ++)
+  {
+    if (count[i])
+    {
+      pair[j ++] = i;
+      pair[j ++] = count[i];
+    }
+  }
+
+  m *= 2;
 
   if (rank == 0)
   {
     ERRMEM (vn = malloc (size * sizeof(int)));
+    ERRMEM (dn = malloc (size * sizeof(int)));
   }
   else
   {
-    vn = NULL;
+    vn = dn = NULL;
   }
 
-  MPI_Gather (&n, 1, MPI_INT, vn, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  MPI_Gather (&m, 1, MPI_INT, vn, 1, MPI_INT, 0, lb->comm);
 
   if (rank == 0)
   {
-
-    ERRMEM (dn = malloc (size * sizeof(int)));
-
-    for (gn = i = 0; i < size; i ++)
+    for (gm = i = 0; i < size; i ++)
     {
-      dn[i] = gn;
-      gn += vn[i];
+      dn[i] = gm;
+      gm += vn[i];
     }
 
-    ERRMEM (gpoint[0] = _dynlb_aligned_real_alloc (gn));
-    ERRMEM (gpoint[1] = _dynlb_aligned_real_alloc (gn));
-    ERRMEM (gpoint[2] = _dynlb_aligned_real_alloc (gn));
+    ERRMEM (gpair = malloc (MAX(gm,1) * sizeof(int)));
   }
+  else gpair = NULL;
+
+  MPI_Gatherv (pair, m, MPI_INT, gpair, vn, dn, MPI_INT, 0, lb->comm);
 
-  MPI_Gatherv (point[0], n, MPI_REAL, gpoint[0], vn, dn, MPI_REAL, 0, MPI_COMM_WORLD);
-  MPI_Gatherv (point[1], n, MPI_REAL, gpoint[1], vn, dn, MPI_REAL, 0, MPI_COMM_WORLD);
-  MPI_Gatherv (point[2], n, MPI_REAL, gpoint[2], vn, dn, MPI_REAL, 0, MPI_COMM_WORLD);
+  ERRMEM (perm = malloc ((size+1) * sizeof(int))); /* new rank of each label followed by the migration count */
 
   if (rank == 0)
   {
-    ERRMEM (gcode = _dynlb_aligned_uint_alloc (gn));
-
-    ERRMEM (gorder = _dynlb_aligned_int_alloc (gn));
-
-    _dynlb_morton_ordering (0, gn, gpoint, gcode, gorder);
+    ERRMEM (entry = malloc (MAX(gm/2,1) * sizeof(struct overlap)));
+    ERRMEM (taken = calloc (size, sizeof(int)));
 
-    ERRMEM (granks = _dynlb_aligned_int_alloc (gn));
+    for (npoint = m = r = 0; r < size; r ++)
+    {
+      for (j = dn[r]; j < dn[r] + vn[r]; j += 2, m ++)
+      {
+	entry[m].label = gpair[j];
+	entry[m].rank = r;
+	entry[m].count = gpair[j+1];
+	npoint += gpair[j+1];
+      }
+    }
 
-    m = gn / size;
+    qsort (entry, m, sizeof(struct overlap), overlap_compare);
 
-    r = gn % size;
+    for (i = 0; i < size; i ++) perm[i] = -1;
 
-    for (i = j = 0; j < size; j ++)
+    for (kept = i = 0; i < m; i ++)
     {
-      for (k = 0; k < m + (r ? 1 : 0); k ++, i ++) /* remainder r is distributed to first r ranks */
+      if (perm[entry[i].label] < 0 && !taken[entry[i].rank] && relabel_allowed (lb, entry[i].label, entry[i].rank))
       {
-	granks[gorder[i]] = j;
+	perm[entry[i].label] = entry[i].rank;
+	taken[entry[i].rank] = 1;
+	kept += entry[i].count;
       }
+    }
 
-      if (r) r --; /* decrement remainder */
+    for (i = 0; i < size; i ++) /* labels without overlaps take remaining ranks */
+    {
+      for (r = 0; r < size && perm[i] < 0; r ++)
+      {
+	if (!taken[r] && relabel_allowed (lb, i, r))
+	{
+	  perm[i] = r;
+	  taken[r] = 1;
+	}
+      }
     }
+
+    perm[size] = npoint - kept;
+
+    free (entry);
+    free (taken);
+    free (gpair);
+    free (vn);
+    free (dn);
   }
 
-  MPI_Scatterv (granks, vn, dn, MPI_INT, ranks, n, MPI_INT, 0, MPI_COMM_WORLD);
+  MPI_Bcast (perm, size+1, MPI_INT, 0, lb->comm);
 
-#if 0
-  if (rank == 0)
-  {
-    printf ("Input size: %d\n", gn);
+  lb->nmigrate = perm[size];
 
-    printf ("Ordering: ");
-    for (i = 0; i < gn; i ++)
-    {
-      printf ("%d ", gorder[i]);
-    }
-    printf ("\n");
+  /* point counts and loads follow their partitions */
+  ERRMEM (all = malloc (2 * size * sizeof(double)));
 
-    printf ("Assigned ranks: ");
-    for (i = 0; i < gn; i ++)
-    {
-      printf ("%d ", granks[i]);
-    }
-    printf ("\n");
+  local[0] = lb->npoint;
+  local[1] = lb->load;
+
+  MPI_Allgather (local, 2, MPI_DOUBLE, all, 2, MPI_DOUBLE, lb->comm);
 
-    int *nn = calloc (size, sizeof(int));
-    for (i = 0; i < gn; i ++) nn[granks[i]] ++;
-    printf ("Assigned points per rank: ");
-    for (i = j = 0; i < size; i ++)
+  for (i = 0; i < size; i ++)
+  {
+    if (perm[i] == rank)
     {
-      printf ("%d ", nn[i]);
-      j += nn[i];
+      lb->npoint = all[2*i];
+      lb->load = all[2*i+1];
     }
-    printf ("\n");
-    free (nn);
+  }
 
-    printf ("Output size: %d\n", j);
+  write = !(nodes && nodes->window != MPI_WIN_NULL) || nodes->leaders != MPI_COMM_NULL; /* node leaders update a shared tree */
+
+  for (i = 0; i < lb->ptree_size && write; i ++)
+  {
+    if (ptree[i].dimension < 0) ptree[i].rank = perm[ptree[i].rank];
   }
-#endif
 
-  if (rank == 0)
+  if (nodes && nodes->window != MPI_WIN_NULL)
   {
-    _dynlb_aligned_int_free (granks);
-    _dynlb_aligned_int_free (gorder);
-    _dynlb_aligned_uint_free (gcode);
-    _dynlb_aligned_real_free (gpoint[0]);
-    _dynlb_aligned_real_free (gpoint[1]);
-    _dynlb_aligned_real_free (gpoint[2]);
-    free (dn);
-    free (vn);
+    MPI_Win_sync (nodes->window);
+    MPI_Barrier (nodes->local);
+    MPI_Win_sync (nodes->window);
   }
+
+  free (ranks);
+  free (count);
+  free (pair);
+  free (perm);
+  free (all);
 }
 
 /* create load balancer */
 struct dynlb* dynlb_create (int ntasks, int n, REAL *point[3], int cutoff, REAL epsilon, enum dynlb_part part)
 {
-  int size, rank, *vn, *dn, gn, i, *rank_size;
-  struct partitioning *ptree;
+  return dynlb_create_comm (MPI_COMM_WORLD, ntasks, n, point, cutoff, epsilon, part, 0);
+}
+
+/* create load balancer on a communicator */
+struct dynlb* dynlb_create_comm (MPI_Comm comm, int ntasks, int n, REAL *point[3], int cutoff, REAL epsilon, enum dynlb_part part, int flags)
+{
+  return dynlb_create_weighted (comm, ntasks, n, point, NULL, NULL, cutoff, epsilon, part, flags);
+}
+
+/* create load balancer on a communicator balancing point weights */
+struct dynlb* dynlb_create_weighted (MPI_Comm comm, int ntasks, int n, REAL *point[3], REAL weight[], REAL capacity[],
+  int cutoff, REAL epsilon, enum dynlb_part part, int flags)
+{
   struct dynlb *lb;
-  REAL *gpoint[3];
-  int leaf_count;
+  int size, i;
+  REAL sum;
 
   ERRMEM (lb = malloc (sizeof(struct dynlb)));
   lb->ntasks = ntasks;
   lb->cutoff = cutoff;
   lb->epsilon = epsilon;
   lb->part = part;
+  lb->flags = flags;
+  lb->comm = comm;
+  lb->update = NULL;
+  lb->wire = NULL;
+  lb->qtree = NULL;
+  lb->halo = 0.0;
+  lb->sample = 4096; /* points per rank with DYNLB_SAMPLE_TREE */
+
+  if (capacity) /* normalized copy */
+  {
+    MPI_Comm_size (comm, &size);
 
-  MPI_Comm_size (MPI_COMM_WORLD, &size);
-  MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+    ERRMEM (lb->capacity = malloc (size * sizeof(REAL)));
 
-  if (rank == 0)
+    for (sum = 0.0, i = 0; i < size; i ++) sum += capacity[i];
+
+    for (i = 0; i < size; i ++) lb->capacity[i] = sum > 0.0 ? capacity[i] / sum : (REAL)1/(REAL)size;
+  }
+  else lb->capacity = NULL;
+
+  if (part == DYNLB_PRCB_TREE || part == DYNLB_HRCB_TREE) /* built on all ranks; there is no broadcast to share */
   {
-    ERRMEM (vn = malloc (size * sizeof(int)));
+    lb->flags &= ~DYNLB_SHARED_TREE;
+  }
+
+  if (part == DYNLB_HRCB_TREE || (lb->flags & DYNLB_SHARED_TREE))
+  {
+    lb->nodes = nodes_create (comm);
   }
   else
   {
-    vn = NULL;
+    lb->nodes = NULL;
   }
 
-  MPI_Gather (&n, 1, MPI_INT, vn, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  lb->policy = DYNLB_EPSILON_POLICY;
+  lb->step_time = 0.0;
+  lb->idle_time = 0.0;
+  lb->rebalanced = 2;
+  lb->timing = 1;
+  lb->timer = MPI_Wtime ();
 
-  if (rank == 0)
-  {
+  tree_build (lb, n, point, weight);
 
-    ERRMEM (dn = malloc (size * sizeof(int)));
+  relabel_ranks (lb, n, point);
 
-    for (gn = i = 0; i < size; i ++)
-    {
-      dn[i] = gn;
-      gn += vn[i];
-    }
+  tree_compile (lb, n, point);
 
-    ERRMEM (gpoint[0] = _dynlb_aligned_real_alloc (gn));
-    ERRMEM (gpoint[1] = _dynlb_aligned_real_alloc (gn));
-    ERRMEM (gpoint[2] = _dynlb_aligned_real_alloc (gn));
-  }
+  lb->rebuild_time = MPI_Wtime () - lb->timer;
 
-  MPI_Gatherv (point[0], n, MPI_REAL, gpoint[0], vn, dn, MPI_REAL, 0, MPI_COMM_WORLD);
-  MPI_Gatherv (point[1], n, MPI_REAL, gpoint[1], vn, dn, MPI_REAL, 0, MPI_COMM_WORLD);
-  MPI_Gatherv (point[2], n, MPI_REAL, gpoint[2], vn, dn, MPI_REAL, 0, MPI_COMM_WORLD);
+  return lb;
+}
 
-  ERRMEM (rank_size = calloc (size, sizeof (int)));
+/* assign an MPI rank to a point; return this rank */
+int dynlb_point_assign (struct dynlb *lb, REAL point[])
+{
+  return _dynlb_query_point_assign (lb->qtree, point);
+}
 
-  if (rank == 0)
-  {
-    switch (part)
-    {
-    case DYNLB_RADIX_TREE:
+/* assign MPI ranks to n points; ranks[] has n entries */
+void dynlb_points_assign (struct dynlb *lb, int n, REAL *point[3], int ranks[])
+{
+  if (n > 0) _dynlb_query_points_assign (lb->ntasks, lb->qtree, n, point, ranks);
+}
 
-      if (cutoff <= 0)
-      {
-	cutoff = gn/size/64; /* more than 64 drives initial imbalance down while increasing local tree size */
-      }
+/* assign MPI ranks to a box spanned between lo and hi points and grown by lb->halo; return the number of ranks assigned */
+int dynlb_box_assign (struct dynlb *lb, REAL lo[], REAL hi[], int ranks[])
+{
+  REAL l[3] = {lo[0]-lb->halo, lo[1]-lb->halo, lo[2]-lb->halo}, h[3] = {hi[0]+lb->halo, hi[1]+lb->halo, hi[2]+lb->halo};
+  int count = 0;
 
-      ptree = _dynlb_partitioning_create_radix (ntasks, gn, gpoint, cutoff, &lb->ptree_size, &leaf_count);
+  _dynlb_query_box_assign (lb->qtree, 0, l, h, ranks, &count);
 
-      break;
-    case DYNLB_RCB_TREE:
+  return count;
+}
 
-      if (cutoff <= 0)
-      {
-	cutoff = -size; /* as many leaves as ranks by default */
-      }
+/* assign MPI ranks to nbox boxes in CSR form; ranks can be NULL to count only; return the total number of ranks */
+int dynlb_boxes_assign (struct dynlb *lb, int nbox, REAL *lo[3], REAL *hi[3], int offsets[], int ranks[])
+{
+  int size;
 
-      ptree = _dynlb_partitioning_create_rcb (ntasks, gn, gpoint, cutoff, &lb->ptree_size, &leaf_count);
+  MPI_Comm_size (lb->comm, &size);
 
-      break;
-    }
+  return _dynlb_query_boxes_assign (lb->ntasks, lb->qtree, size, nbox, lo, hi, lb->halo, offsets, ranks);
+}
 
-    _dynlb_partitioning_assign_ranks (ptree, leaf_count / size, leaf_count % size);
+/* find ranks other than the owner within radius of points in CSR form; ranks can be NULL to count only; return the total */
+int dynlb_ghosts (struct dynlb *lb, int n, REAL *point[3], REAL radius, int offsets[], int ranks[])
+{
+  int size;
 
-    _dynlb_partitioning_store (ntasks, ptree, gn, gpoint);
+  MPI_Comm_size (lb->comm, &size);
 
-#if 0
-    printf ("Leaf count: %d\n", leaf_count);
+  return _dynlb_query_ghosts (lb->ntasks, lb->qtree, size, n, point, radius, offsets, ranks);
+}
 
-    printf ("Leaf ranks: ");
-    for (i = 0; i < lb->ptree_size; i ++)
-    {
-      if (ptree[i].dimension < 0) /* leaf */
-      {
-	printf ("%d ", ptree[i].rank);
-      }
-    }
-    printf ("\n");
+/* get the regions of rank; *count boxes of 6 entries each, lower then upper corner, are returned in *boxes */
+void dynlb_rank_extents (struct dynlb *lb, int rank, REAL **boxes, int *count)
+{
+  struct query_tree *qtree = lb->qtree;
+  int size;
 
-    printf ("Leaf sizes: ");
-    for (i = 0; i < lb->ptree_size; i ++)
-    {
-      if (ptree[i].dimension < 0) /* leaf */
-      {
-	printf ("%d ", ptree[i].size);
-      }
-    }
-    printf ("\n");
-#endif
+  MPI_Comm_size (lb->comm, &size);
 
-    /* determine initial imbalance */
+  if (rank < 0 || rank >= size || !qtree || !qtree->region || !qtree->rank_region) /* no such rank or tree being rebuilt */
+  {
+    *boxes = NULL;
+    *count = 0;
+    return;
+  }
 
-    for (i = 0; i < lb->ptree_size; i ++)
-    {
-      if (ptree[i].dimension < 0) /* leaf */
-      {
-	rank_size[ptree[i].rank] += ptree[i].size;
-      }
-    }
+  *boxes = &qtree->region[6*qtree->rank_region[rank]];
+  *count = qtree->rank_region[rank+1] - qtree->rank_region[rank];
+}
 
-    int min_size = INT_MAX, max_size = 0;
+struct dynlb_migration /* nonblocking point migration state */
+{
+  MPI_Request request;
+  MPI_Datatype record_type; /* one point record */
+  int record; /* record size in bytes */
+  int size; /* communicator size */
+  int nrecv; /* number of received points */
+  int nattr;
+  int *attr_size;
+  int *sendcount, *senddispl, *recvcount, *recvdispl; /* in records */
+  char *sendbuf, *recvbuf;
+  struct dynlb *lb; /* balancer whose rebuild cost includes this migration or NULL */
+  double time; /* start time */
+};
+
+/* begin nonblocking point migration; point[] and attr[] arrays can still be read until dynlb_migrate_end is called */
+struct dynlb_migration* dynlb_migrate_begin (struct dynlb *lb, int n, REAL *point[3], int nattr, void *attr[], int attr_size[])
+{
+  int i, k, size, tasks, *task_count, *ranks;
+  struct dynlb_migration *mig;
 
-    for (i = 0; i < size; i ++)
-    {
-      min_size = MIN (min_size, rank_size[i]);
-      max_size = MAX (max_size, rank_size[i]);
-    }
+  MPI_Comm_size (lb->comm, &size);
 
-    lb->imbalance = (REAL)max_size/(REAL)min_size;
+  ERRMEM (mig = malloc (sizeof(struct dynlb_migration)));
+  ERRMEM (mig->attr_size = malloc (MAX(nattr,1) * sizeof(int)));
+  ERRMEM (mig->sendcount = malloc (size * sizeof(int)));
+  ERRMEM (mig->senddispl = malloc (size * sizeof(int)));
+  ERRMEM (mig->recvcount = malloc (size * sizeof(int)));
+  ERRMEM (mig->recvdispl = malloc (size * sizeof(int)));
 
-    if (isnan(lb->imbalance)) lb->imbalance = (REAL)1/(REAL)0; /* inf istead */
+  mig->size = size;
+  mig->nattr = nattr;
+  mig->lb = lb->timing ? lb : NULL;
+  mig->time = MPI_Wtime ();
+
+  lb->timing = 0;
+
+  for (mig->record = 3*sizeof(REAL), k = 0; k < nattr; k ++)
+  {
+    mig->attr_size[k] = attr_size[k];
+    mig->record += attr_size[k];
   }
 
-  /* broadcast ptree_size and initial imbalance */
-  MPI_Bcast (lb, sizeof(struct dynlb), MPI_BYTE, 0, MPI_COMM_WORLD);
+  mig->record = (mig->record + sizeof(REAL) - 1) / sizeof(REAL) * sizeof(REAL); /* keep coordinate blocks aligned */
 
-  /* broadcast rank_size and update lb->npoint */
-  MPI_Bcast (rank_size, size, MPI_INT, 0, MPI_COMM_WORLD);
+  MPI_Type_contiguous (mig->record, MPI_BYTE, &mig->record_type);
+  MPI_Type_commit (&mig->record_type);
 
-  lb->npoint = rank_size[rank];
+  /* destination ranks */
+  ERRMEM (ranks = _dynlb_aligned_int_alloc (n));
 
-  if (rank == 0)
+  _dynlb_query_points_assign (lb->ntasks, lb->qtree, n, point, ranks);
+
+  _dynlb_migrate_count (lb->ntasks, n, ranks, size, &task_count, &tasks, mig->sendcount);
+
+  MPI_Alltoall (mig->sendcount, 1, MPI_INT, mig->recvcount, 1, MPI_INT, lb->comm);
+
+  for (mig->senddispl[0] = mig->recvdispl[0] = 0, i = 1; i < size; i ++)
   {
-    lb->ptree = ptree;
+    mig->senddispl[i] = mig->senddispl[i-1] + mig->sendcount[i-1];
+    mig->recvdispl[i] = mig->recvdispl[i-1] + mig->recvcount[i-1];
   }
-  else
+
+  mig->nrecv = mig->recvdispl[size-1] + mig->recvcount[size-1];
+
+  ERRMEM (mig->sendbuf = malloc ((size_t)MAX(n,1) * mig->record));
+  ERRMEM (mig->recvbuf = malloc ((size_t)MAX(mig->nrecv,1) * mig->record));
+
+  /* single pass counting sort into the send buffer */
+  _dynlb_migrate_pack (n, point, nattr, attr, attr_size, ranks, size, task_count, tasks,
+                       mig->sendcount, mig->senddispl, mig->record, (int8_t*)mig->sendbuf);
+
+  _dynlb_aligned_int_free (ranks);
+
+  MPI_Ialltoallv (mig->sendbuf, mig->sendcount, mig->senddispl, mig->record_type,
+                  mig->recvbuf, mig->recvcount, mig->recvdispl, mig->record_type, lb->comm, &mig->request);
+
+  return mig;
+}
+
+/* end nonblocking point migration; point[] and attr[] arrays are freed, replaced and the new number of points is returned */
+int dynlb_migrate_end (struct dynlb_migration *mig, REAL *point[3], void *attr[])
+{
+  int k, n = mig->nrecv;
+
+  MPI_Wait (&mig->request, MPI_STATUS_IGNORE);
+
+  for (k = 0; k < 3; k ++)
   {
-    lb->ptree = _dynlb_partitioning_alloc (lb->ptree_size);
+    free (point[k]);
+    ERRMEM (point[k] = malloc (MAX(n,1) * sizeof(REAL)));
   }
 
-  /* broadcast ptree */
-  MPI_Bcast (lb->ptree, lb->ptree_size*sizeof(struct partitioning), MPI_BYTE, 0, MPI_COMM_WORLD);
-
-  if (rank == 0)
+  for (k = 0; k < mig->nattr; k ++)
   {
-    _dynlb_aligned_real_free (gpoint[0]);
-    _dynlb_aligned_real_free (gpoint[1]);
-    _dynlb_aligned_real_free (gpoint[2]);
-    free (dn);
-    free (vn);
+    free (attr[k]);
+    ERRMEM (attr[k] = malloc ((size_t)MAX(n,1) * mig->attr_size[k]));
   }
 
-  free (rank_size);
+  _dynlb_migrate_unpack (mig->size, (int8_t*)mig->recvbuf, mig->recvcount, mig->recvdispl,
+                         mig->record, point, mig->nattr, attr, mig->attr_size);
 
-  return lb;
+  if (mig->lb) mig->lb->rebuild_time += MPI_Wtime () - mig->time; /* first migration after a rebuild */
+
+  MPI_Type_free (&mig->record_type);
+  free (mig->attr_size);
+  free (mig->sendcount);
+  free (mig->senddispl);
+  free (mig->recvcount);
+  free (mig->recvdispl);
+  free (mig->sendbuf);
+  free (mig->recvbuf);
+  free (mig);
+
+  return n;
 }
 
-/* assign an MPI rank to a point; return this rank */
-int dynlb_point_assign (struct dynlb *lb, REAL point[])
+/* migrate points and their attributes to ranks assigned by the partitioning tree; attribute k has attr_size[k] bytes
+ * per point; point[] and attr[] arrays must be malloc-ed; they are freed, replaced and the new number of points is returned */
+int dynlb_migrate (struct dynlb *lb, int n, REAL *point[3], int nattr, void *attr[], int attr_size[])
 {
-  return _dynlb_partitioning_point_assign (lb->ptree, 0, point);
+  struct dynlb_migration *mig = dynlb_migrate_begin (lb, n, point, nattr, attr, attr_size);
+
+  return dynlb_migrate_end (mig, point, attr);
 }
 
-/* assign MPI ranks to a box spanned between lo and hi points; return the number of ranks assigned */
-int dynlb_box_assign (struct dynlb *lb, REAL lo[], REAL hi[], int ranks[])
+/* decide whether to rebalance; the epsilon policy tests imbalance against epsilon; the cost policy accumulates idle time
+ * predicted as step_time * (1 - 1/imbalance) since the last rebuild and rebalances once it exceeds the cost of that rebuild */
+static int rebalance_needed (struct dynlb *lb)
 {
-  int count = 0;
+  double now = MPI_Wtime (), local[2], global[2];
 
-  _dynlb_partitioning_box_assign (lb->ptree, 0, lo, hi, ranks, &count);
+  local[0] = now - lb->timer;
+  local[1] = lb->rebuild_time;
 
-  return count;
+  lb->timer = now;
+
+  if (lb->policy == DYNLB_COST_POLICY)
+  {
+    MPI_Allreduce (local, global, 2, MPI_DOUBLE, MPI_MAX, lb->comm); /* the slowest rank sets the pace */
+
+    lb->step_time = global[0];
+    lb->rebuild_time = global[1];
+
+    if (isnan (lb->imbalance) || isinf(lb->imbalance)) lb->idle_time += lb->step_time;
+    else if (lb->imbalance > 1.0) lb->idle_time += lb->step_time * (1.0 - 1.0/lb->imbalance);
+
+    return lb->idle_time > lb->rebuild_time;
+  }
+
+  lb->step_time = local[0];
+
+  return imbalanced (lb);
 }
 
 /* update load balancer */
 void dynlb_update (struct dynlb *lb, int n, REAL *point[3])
 {
-  int i, rank, size, *local_size, *rank_size;
-  struct partitioning *ptree = lb->ptree;
+  dynlb_update_begin (lb, n, point);
 
-  MPI_Comm_size (MPI_COMM_WORLD, &size);
-  MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+  dynlb_update_end (lb, n, point);
+}
 
-  _dynlb_partitioning_store (lb->ntasks, ptree, n, point);
+/* update load balancer balancing point weights */
+void dynlb_update_weighted (struct dynlb *lb, int n, REAL *point[3], REAL weight[])
+{
+  dynlb_update_weighted_begin (lb, n, point, weight);
 
-  ERRMEM (local_size = calloc (size, sizeof (int)));
+  dynlb_update_end (lb, n, point);
+}
 
-  ERRMEM (rank_size = calloc (size, sizeof (int)));
+/* begin load balancer update; the imbalance reduction proceeds in the background until dynlb_update_end is called */
+void dynlb_update_begin (struct dynlb *lb, int n, REAL *point[3])
+{
+  lb->update = imbalance_begin (lb, n, point, NULL);
+}
 
-  for (i = 0; i < lb->ptree_size; i ++)
-  {
-    if (ptree[i].dimension < 0) /* leaf */
-    {
-      local_size[ptree[i].rank] += ptree[i].size;
-    }
-  }
+/* begin weighted load balancer update; weights must be kept unchanged until dynlb_update_end is called */
+void dynlb_update_weighted_begin (struct dynlb *lb, int n, REAL *point[3], REAL weight[])
+{
+  lb->update = imbalance_begin (lb, n, point, weight);
+}
 
-  /* reduce global sizes per rank */
-  MPI_Allreduce (local_size, rank_size, size, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+/* end load balancer update; points must be the same as those passed to dynlb_update_begin */
+void dynlb_update_end (struct dynlb *lb, int n, REAL *point[3])
+{
+  struct imbalance *imb = lb->update;
+  REAL *weight = imb->weight;
+  double *rank_load = NULL;
+  int size, i, k, repaired;
 
-  lb->npoint = rank_size[rank];
+  if (lb->part == DYNLB_HRCB_TREE)
+  {
+    MPI_Comm_size (lb->comm, &size);
 
-  int min_size = INT_MAX, max_size = 0;
+    ERRMEM (rank_load = malloc (size * sizeof(double)));
+  }
 
-  for (i = 0; i < size; i ++)
+  imbalance_end (lb, imb, rank_load);
+
+  if (rank_load && lb->capacity) /* loads relative to capacities are compared among nodes and ranks */
   {
-    min_size = MIN (min_size, rank_size[i]);
-    max_size = MAX (max_size, rank_size[i]);
+    for (i = 0; i < size; i ++) rank_load[i] = lb->capacity[i] > 0.0 ? rank_load[i] / lb->capacity[i] : (rank_load[i] > 0.0 ? REAL_MAX : 0.0);
   }
 
-  lb->imbalance = (REAL)max_size/(REAL)min_size;
+  lb->update = NULL;
 
-  free (local_size);
-  free (rank_size);
+  lb->rebalanced = 0;
 
-  if (isnan (lb->imbalance) || isinf(lb->imbalance) ||
-      lb->imbalance > 1.0 + lb->epsilon) /* update partitioning */
+  if (rebalance_needed (lb))
   {
-    struct dynlb *dy = dynlb_create (lb->ntasks, n, point, lb->cutoff, lb->epsilon, lb->part);
+    query_destroy (lb); /* stale while ptree changes; compiled again below */
 
-    _dynlb_partitioning_destroy (lb->ptree);
-    lb->ptree = dy->ptree;
-    lb->ptree_size = dy->ptree_size;
+    repaired = 0;
+
+    if (lb->part == DYNLB_HRCB_TREE) /* try to correct nodes locally first */
+    {
+      if ((k = hrcb_repair (lb, n, point, weight, rank_load)))
+      {
+	update_imbalance (lb, n, point, weight, NULL);
+	repaired += k;
+      }
+    }
+
+    if ((lb->part == DYNLB_RCB_TREE || lb->part == DYNLB_PRCB_TREE || lb->part == DYNLB_HRCB_TREE || lb->part == DYNLB_MJ_TREE) &&
+	(lb->policy == DYNLB_COST_POLICY || imbalanced (lb))) /* try to move skewed split planes first; the cost policy has decided already */
+    {
+      if ((k = prcb_repair (lb, n, point, weight)))
+      {
+	update_imbalance (lb, n, point, weight, NULL);
+	repaired += k;
+      }
+    }
+
+    if (repaired)
+    {
+      lb->rebalanced = 1;
+      lb->idle_time = 0.0;
+    }
+
+    if (!repaired || imbalanced (lb)) /* update partitioning */
+    {
+      double time;
 
-    lb->imbalance = dy->imbalance;
-    lb->npoint = dy->npoint;
+      tree_destroy (lb); /* node layout is reused */
 
-    free (dy);
+      time = MPI_Wtime ();
+
+      tree_build (lb, n, point, weight);
+
+      relabel_ranks (lb, n, point);
+
+      tree_compile (lb, n, point);
+
+      lb->rebalanced = 2;
+      lb->idle_time = 0.0;
+      lb->rebuild_time = MPI_Wtime () - time; /* the same span as in dynlb_create; the next migration is added */
+      lb->timing = 1;
+    }
+    else tree_compile (lb, n, point); /* repaired planes */
   }
+
+  free (rank_load);
 }
 
 /* destroy load balancer */
 void dynlb_destroy (struct dynlb *lb)
 {
-  _dynlb_partitioning_destroy (lb->ptree);
+  query_destroy (lb);
+  tree_destroy (lb);
+  if (lb->nodes) nodes_destroy (lb->nodes);
+  if (lb->wire)
+  {
+    struct wire *wire = lb->wire;
+    free (wire->dim);
+    free (wire->coord);
+    free (wire);
+  }
+  free (lb->capacity);
   free (lb);
 }
@@ -25,13 +25,49 @@ SOFTWARE.
 #ifndef __dynlb__
 #define __dynlb__
 
+#include <mpi.h>
+
 /* simple morton ordering based point balancer */
 void dynlb_morton_balance (int n, REAL *point[3], int ranks[]);
 
+/* simple morton ordering based point balancer on a communicator; splitters found by a call are attached to comm
+ * and speed up the next call on it */
+void dynlb_morton_balance_comm (MPI_Comm comm, int n, REAL *point[3], int ranks[]);
+
+/* simple hilbert ordering based point balancer; rank regions are more compact than with morton ordering */
+void dynlb_hilbert_balance (int n, REAL *point[3], int ranks[]);
+
+/* simple hilbert ordering based point balancer on a communicator */
+void dynlb_hilbert_balance_comm (MPI_Comm comm, int n, REAL *point[3], int ranks[]);
+
 enum dynlb_part /* space partitioning type */
 {
   DYNLB_RADIX_TREE, /* radix tree based on morton ordering */
-  DYNLB_RCB_TREE /* recursive coordinate bisection tree */
+  DYNLB_RCB_TREE, /* recursive coordinate bisection tree */
+  DYNLB_PRCB_TREE, /* parallel recursive coordinate bisection tree; built on all ranks without gathering points */
+  DYNLB_HRCB_TREE, /* hierarchical parallel rcb tree; top levels split among shared memory nodes, then among ranks of each node;
+		      planes within a node are repaired locally only when points were migrated to their owners before the update */
+  DYNLB_MJ_TREE /* multi-jagged tree; nodes are cut into up to 8 parts at once, giving a shallower tree than rcb with the same leaves */
+};
+
+enum dynlb_flags /* optional load balancer behaviour */
+{
+  DYNLB_SHARED_TREE = 1, /* keep one partitioning tree copy per shared memory node in an MPI-3 window; trees built on rank 0 only;
+			   node leaders also compile the query tree with its regions and boxes into a node shared window */
+  DYNLB_MORTON_CODES = 2, /* gather morton codes computed on all ranks instead of coordinates; radix tree only */
+  DYNLB_SAMPLE_TREE = 4, /* gather a stratified random sample of lb->sample points per rank instead of all points; radix, rcb and mj trees */
+  DYNLB_HILBERT = 8, /* order points by hilbert instead of morton codes; radix tree only; ranks receive more compact regions */
+  DYNLB_CUBIC_CODES = 16, /* quantize codes within a cube of the largest extent instead of per axis; radix tree only; for elongated domains */
+  DYNLB_WIDE_TREE = 32, /* compile eight way nodes for point queries and update counting; about log8(leaves) node visits per point */
+  DYNLB_LEAF_BOXES = 64 /* bound the points of each leaf and subtree at every update; box queries skip ranks with no points near a box;
+			  the bounds are stale between updates, so lb->halo must also cover how far points move since the last update */
+};
+
+enum dynlb_policy /* rebalancing policy */
+{
+  DYNLB_EPSILON_POLICY, /* rebalance when imbalance, max/min of rank loads, exceeds 1.0 + epsilon (default) */
+  DYNLB_COST_POLICY /* imbalance is max/avg of rank loads; rebalance when idle time predicted from imbalance and step times,
+		       accumulated since the last rebuild, exceeds the measured time of that rebuild and the migration after it */
 };
 
 struct dynlb /* load balancer interface */
@@ -40,26 +76,103 @@ struct dynlb /* load balancer interface */
   int cutoff; /* partitioning tree cutoff; 0 means use default selection */
   REAL epsilon; /* imbalance epsilon; rebalance when imbalance > 1.0 + epsilon */
   enum dynlb_part part; /* partitioning type */
+  int flags; /* dynlb_flags combination */
+  int sample; /* number of points sampled per rank with DYNLB_SAMPLE_TREE; doubled while the sampled tree's imbalance exceeds epsilon,
+		 up to the largest number of points per rank */
+  MPI_Comm comm; /* communicator of the balanced ranks */
+  REAL halo; /* box queries are grown by halo, e.g. to find ranks with points within halo of a box with DYNLB_LEAF_BOXES; default 0 */
 
   void *ptree; /* partitioning tree; used internally */
   int ptree_size; /* partitioning tree size; used internally */
+  void *qtree; /* breadth first query tree compiled from ptree after each rebalancing; used internally */
+  void *nodes; /* shared memory node layout of hierarchical partitioning or shared trees; used internally */
+  void *update; /* pending split-phase update; used internally */
+  void *wire; /* last broadcast tree; used internally */
 
-  REAL imbalance; /* current imbalance */
+  REAL imbalance; /* current imbalance; of point weights when they are given */
   int npoint; /* current number of points on this MPI rank */
+  REAL load; /* current sum of point weights on this MPI rank; equal to npoint without weights */
+  REAL *capacity; /* relative rank capacities normalized to sum up to one or NULL */
+  int nmigrate; /* number of points expected to migrate after the last tree rebuild; rebuilt trees keep rank ownership where possible */
+
+  enum dynlb_policy policy; /* rebalancing policy; can be changed between updates */
+  int rebalanced; /* decision of the last update: 0 kept, 1 split planes repaired, 2 tree rebuilt */
+  double step_time; /* time between the two latest updates; maximum over ranks with the cost policy */
+  double idle_time; /* idle time predicted since the last rebalancing; cost policy */
+  double rebuild_time; /* time of the last tree rebuild and the first migration after it; maximum over ranks with the cost policy */
+  int timing; /* time the next migration; used internally */
+  double timer; /* time of the latest update; used internally */
 };
 
 /* create load balancer */
 struct dynlb* dynlb_create (int ntasks, int n, REAL *point[3], int cutoff, REAL epsilon, enum dynlb_part part);
 
+/* create load balancer on a communicator; ranks assigned by the balancer are ranks within comm; flags are dynlb_flags */
+struct dynlb* dynlb_create_comm (MPI_Comm comm, int ntasks, int n, REAL *point[3], int cutoff, REAL epsilon, enum dynlb_part part, int flags);
+
+/* create load balancer on a communicator balancing point weights, e.g. computational costs, instead of point counts;
+ * weight is NULL or given on all ranks; capacity is NULL or gives relative capacities of all ranks in comm (the same
+ * array on every rank), in which case ranks receive loads proportional to their capacities and imbalance becomes
+ * the largest ratio of a rank's load to its capacity target */
+struct dynlb* dynlb_create_weighted (MPI_Comm comm, int ntasks, int n, REAL *point[3], REAL weight[], REAL capacity[],
+  int cutoff, REAL epsilon, enum dynlb_part part, int flags);
+
 /* assign an MPI rank to a point; return this rank */
 int dynlb_point_assign (struct dynlb *lb, REAL point[]);
 
-/* assign MPI ranks to a box spanned between lo and hi points; return the number of ranks assigned */
+/* assign MPI ranks to n points; ranks[] has n entries; the batch is split across tasks and walked in SIMD gangs */
+void dynlb_points_assign (struct dynlb *lb, int n, REAL *point[3], int ranks[]);
+
+/* assign MPI ranks to a box spanned between lo and hi points and grown by lb->halo; return the number of ranks assigned */
 int dynlb_box_assign (struct dynlb *lb, REAL lo[], REAL hi[], int ranks[]);
 
+/* assign MPI ranks to nbox boxes spanned between lo[.][i] and hi[.][i] points and grown by lb->halo; distinct ranks of box i are returned in
+ * ranks[offsets[i]] ... ranks[offsets[i+1]-1], where offsets[] has nbox+1 entries; when ranks is NULL only offsets are
+ * computed, so that ranks[] can be allocated with offsets[nbox] entries; return offsets[nbox] */
+int dynlb_boxes_assign (struct dynlb *lb, int nbox, REAL *lo[3], REAL *hi[3], int offsets[], int ranks[]);
+
+/* find, for each of n points, the ranks other than its owner whose regions come within euclidean distance radius of the
+ * point, i.e. the ranks needing a ghost copy; with DYNLB_LEAF_BOXES the bounding box of the rank's points in such a region
+ * must also come within radius, which keeps a superset of the ranks with points within radius; ranks of point i
+ * are returned in ranks[offsets[i]] ... ranks[offsets[i+1]-1], where offsets[] has n+1 entries; when ranks is NULL only
+ * offsets are computed, so that ranks[] can be allocated with offsets[n] entries; return offsets[n] */
+int dynlb_ghosts (struct dynlb *lb, int n, REAL *point[3], REAL radius, int offsets[], int ranks[]);
+
+/* get the regions of rank; *count boxes of 6 entries each, lower then upper corner, are returned in *boxes, which stays
+ * valid until the next update; a point p belongs to rank when lo <= p < hi for one of its boxes, which allows to check
+ * cheaply whether points stay local; boxes on the domain boundary extend to +/-REAL_MAX; *count is 0 and *boxes NULL
+ * for ranks outside the communicator or while the tree is being rebuilt */
+void dynlb_rank_extents (struct dynlb *lb, int rank, REAL **boxes, int *count);
+
+/* nonblocking point migration state */
+struct dynlb_migration;
+
+/* migrate points and their attributes to ranks assigned by the partitioning tree; attribute k has attr_size[k] bytes
+ * per point; point[] and attr[] arrays must be malloc-ed; they are freed, replaced and the new number of points is returned */
+int dynlb_migrate (struct dynlb *lb, int n, REAL *point[3], int nattr, void *attr[], int attr_size[]);
+
+/* begin nonblocking point migration; point[] and attr[] arrays can still be read until dynlb_migrate_end is called;
+ * lb must not be destroyed before then, since the first migration after a rebuild adds its time to lb->rebuild_time */
+struct dynlb_migration* dynlb_migrate_begin (struct dynlb *lb, int n, REAL *point[3], int nattr, void *attr[], int attr_size[]);
+
+/* end nonblocking point migration; point[] and attr[] arrays are freed, replaced and the new number of points is returned */
+int dynlb_migrate_end (struct dynlb_migration *mig, REAL *point[3], void *attr[]);
+
 /* update load balancer */
 void dynlb_update (struct dynlb *lb, int n, REAL *point[3]);
 
+/* update load balancer balancing point weights; weight is NULL or given on all ranks */
+void dynlb_update_weighted (struct dynlb *lb, int n, REAL *point[3], REAL weight[]);
+
+/* begin load balancer update; the imbalance reduction proceeds in the background until dynlb_update_end is called */
+void dynlb_update_begin (struct dynlb *lb, int n, REAL *point[3]);
+
+/* begin weighted load balancer update; weights must be kept unchanged until dynlb_update_end is called */
+void dynlb_update_weighted_begin (struct dynlb *lb, int n, REAL *point[3], REAL weight[]);
+
+/* end load balancer update and rebalance if needed; points must be the same as those passed to dynlb_update_(weighted_)begin */
+void dynlb_update_end (struct dynlb *lb, int n, REAL *point[3]);
+
 /* destroy load balancer */
 void dynlb_destroy (struct dynlb *lb);
 
@@ -25,8 +25,20 @@ SOFTWARE.
 #ifndef __morton__
 #define __morton__
 
+/* bits per axis of morton and hilbert codes and the number of quantization levels per axis */
+#define MORTON_BITS 21
+#define MORTON_LEVELS (1u << MORTON_BITS)
+
 /* morton ordering */
-export void _dynlb_morton_ordering (uniform int ntasks, uniform int n, uniform REAL * uniform point[3], uniform unsigned int code[], uniform int order[]);
+export void _dynlb_morton_ordering (uniform int ntasks, uniform int n, uniform REAL * uniform point[3], uniform uint64 code[], uniform int order[]);
+
+/* morton ordering within given extents */
+export void _dynlb_morton_ordering_extents (uniform int ntasks, uniform int n, uniform REAL * uniform point[3],
+  uniform REAL extents[], uniform uint64 code[], uniform int order[]);
+
+/* hilbert ordering within given extents */
+export void _dynlb_hilbert_ordering_extents (uniform int ntasks, uniform int n, uniform REAL * uniform point[3],
+  uniform REAL extents[], uniform uint64 code[], uniform int order[]);
 
 /* task based and vectorized extents of points */
 void extents_of_points (uniform int ntasks, uniform int n, uniform REAL * uniform point[3], uniform REAL extents[]);
@@ -34,11 +34,17 @@ struct radix_tree /* binary space partitioning radix tree */
 
   uniform REAL coord;
   uniform int dimension;
+  uniform int flip; /* lower codes lie above the split plane; hilbert codes only */
 };
 
-/* create radix tree */
-uniform radix_tree * uniform radix_tree_create (uniform int ntasks, uniform int n,
-  uniform REAL * uniform point[3], uniform int cutoff, uniform int * uniform tree_size);
+/* create radix tree of morton or hilbert codes computed within extents, or extents of points when extents are NULL;
+ * leaves are of weight <= cutoff times the average weight when weight is not NULL */
+uniform radix_tree * uniform radix_tree_create (uniform int ntasks, uniform int n, uniform REAL * uniform point[3],
+  uniform REAL weight[], uniform REAL extents[], uniform int hilbert, uniform int cutoff, uniform int * uniform tree_size);
+
+/* create radix tree from morton or hilbert codes computed within extents; codes are sorted in place; weight can be NULL */
+uniform radix_tree * uniform radix_tree_create_codes (uniform int ntasks, uniform int n, uniform uint64 code[],
+  uniform REAL weight[], uniform REAL extents[], uniform int hilbert, uniform int cutoff, uniform int * uniform tree_size);
 
 /* destroy radix tree */
 void radix_tree_destroy (uniform radix_tree * uniform rtree);
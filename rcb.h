@@ -33,9 +33,17 @@ struct rcb_tree /* binary space partitioning recurisve bisection tree */
   uniform int right;
 };
 
-/* create rcb tree; uniformly bisect untill leaf size <= cutoff; or if cutoff < 0 then create -cutoff equal size leaves */
+/* create rcb tree; uniformly bisect untill leaf size <= cutoff; or if cutoff < 0 then create -cutoff equal size leaves;
+ * when weight is not NULL leaves are of equal weight instead of size and weight is reordered together with points;
+ * when share is not NULL and cutoff < 0 leaf sizes (weights) are proportional to share[0...-cutoff-1] in leaf order */
 uniform rcb_tree * uniform rcb_tree_create (uniform int ntasks, uniform int n,
-  uniform REAL * uniform point[3], uniform int cutoff, uniform int * uniform tree_size);
+  uniform REAL * uniform point[3], uniform REAL weight[], uniform REAL share[], uniform int cutoff, uniform int * uniform tree_size);
+
+/* create multi-jagged tree: nodes are cut into up to 8 parts at once along their longest extent untill leaf size <= cutoff;
+ * or if cutoff < 0 then -cutoff leaves are created; weight and share are used as in rcb_tree_create; nodes of one cut
+ * are stored as a balanced binary subtree of rcb tree nodes; the tree is destroyed with rcb_tree_destroy */
+uniform rcb_tree * uniform mj_tree_create (uniform int ntasks, uniform int n,
+  uniform REAL * uniform point[3], uniform REAL weight[], uniform REAL share[], uniform int cutoff, uniform int * uniform tree_size);
 
 /* destroy rcb tree */
 void rcb_tree_destroy (uniform rcb_tree * uniform rcbtree);
@@ -34,10 +34,10 @@
 #ifndef __sort__
 #define __sort__
 
-/* parallel radix sort on unsigned integers */
-void radix_sort (uniform int ntasks, uniform int n, uniform unsigned int code[], uniform int order[]);
+/* parallel radix sort on 64-bit unsigned integers; order is set to the sorting permutation */
+void radix_sort (uniform int ntasks, uniform int n, uniform uint64 code[], uniform int order[]);
 
-/* serial quick sort on unsigned integers */
-void quick_sort (uniform int n, uniform unsigned int a[], uniform int order[]);
+/* serial quick sort on 64-bit unsigned integers; order is permuted along */
+void quick_sort (uniform int n, uniform uint64 a[], uniform int order[]);
 
 #endif
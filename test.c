@@ -45,12 +45,410 @@ double ptimerend (struct timing *t)
   return time;
 }
 
+/* check that migrated points are assigned to this rank, that their number is preserved and that
+ * the attribute, a copy of the x coordinate, followed its point; return the number of failures */
+int check_migration (struct dynlb *lb, int n0, int n, REAL *point[3], REAL *attr)
+{
+  int i, rank, errors[2], total[2];
+
+  MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+
+  MPI_Allreduce (&n0, &total[0], 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+  MPI_Allreduce (&n, &total[1], 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+  for (i = errors[0] = 0; i < n; i ++)
+  {
+    REAL p[3] = {point[0][i], point[1][i], point[2][i]};
+
+    if (dynlb_point_assign (lb, p) != rank || attr[i] != point[0][i]) errors[0] ++;
+  }
+
+  errors[0] += (total[0] != total[1]);
+
+  MPI_Allreduce (&errors[0], &errors[1], 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+  return errors[1];
+}
+
+/* check that batched point assignment agrees with single point assignment; return the number of failures */
+int check_points_assign (struct dynlb *lb, int n, REAL *point[3])
+{
+  int i, *ranks, errors[2];
+
+  ERRMEM (ranks = malloc (MAX(n,1) * sizeof (int)));
+
+  dynlb_points_assign (lb, n, point, ranks);
+
+  for (i = errors[0] = 0; i < n; i ++)
+  {
+    REAL p[3] = {point[0][i], point[1][i], point[2][i]};
+
+    if (dynlb_point_assign (lb, p) != ranks[i]) errors[0] ++;
+  }
+
+  MPI_Allreduce (&errors[0], &errors[1], 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+  free (ranks);
+
+  return errors[1];
+}
+
+/* check that counting box ranks (ranks == NULL) agrees with filling them and that boxes around local
+ * points report this rank; return the number of failures */
+int check_boxes_assign (struct dynlb *lb, int n, REAL *point[3])
+{
+  int i, j, d, k, rank, total, *offsets[2], *ranks, errors[2];
+  REAL *lo[3], *hi[3];
+
+  MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+
+  for (d = 0; d < 3; d ++)
+  {
+    ERRMEM (lo[d] = malloc (MAX(n,1) * sizeof (REAL)));
+    ERRMEM (hi[d] = malloc (MAX(n,1) * sizeof (REAL)));
+
+    for (i = 0; i < n; i ++)
+    {
+      lo[d][i] = point[d][i] - 0.05;
+      hi[d][i] = point[d][i] + 0.05;
+    }
+  }
+
+  ERRMEM (offsets[0] = malloc ((n+1) * sizeof (int)));
+  ERRMEM (offsets[1] = malloc ((n+1) * sizeof (int)));
+
+  total = dynlb_boxes_assign (lb, n, lo, hi, offsets[0], NULL);
+
+  ERRMEM (ranks = malloc (MAX(total,1) * sizeof (int)));
+
+  errors[0] = dynlb_boxes_assign (lb, n, lo, hi, offsets[1], ranks) != total;
+
+  for (i = 0; i <= n; i ++)
+  {
+    if (offsets[0][i] != offsets[1][i]) errors[0] ++;
+  }
+
+  for (i = 0; i < n && !errors[0]; i ++)
+  {
+    for (k = 0, j = offsets[1][i]; j < offsets[1][i+1]; j ++) k += ranks[j] == rank;
+
+    if (k != 1) errors[0] ++;
+  }
+
+  MPI_Allreduce (&errors[0], &errors[1], 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+  for (d = 0; d < 3; d ++)
+  {
+    free (lo[d]);
+    free (hi[d]);
+  }
+  free (offsets[0]);
+  free (offsets[1]);
+  free (ranks);
+
+  return errors[1];
+}
+
+/* check that every local point lies in one of this rank's region boxes and that ranks outside
+ * the communicator have no regions; return the number of failures */
+int check_rank_extents (struct dynlb *lb, int n, REAL *point[3])
+{
+  int i, j, d, k, rank, size, count, errors[2];
+  REAL *boxes, *b;
+
+  MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+  MPI_Comm_size (MPI_COMM_WORLD, &size);
+
+  dynlb_rank_extents (lb, size, &boxes, &count);
+
+  errors[0] = count != 0 || boxes != NULL;
+
+  dynlb_rank_extents (lb, rank, &boxes, &count);
+
+  for (i = 0; i < n; i ++)
+  {
+    for (k = j = 0; j < count && !k; j ++)
+    {
+      for (b = &boxes[6*j], k = 1, d = 0; d < 3; d ++)
+      {
+	if (point[d][i] < b[d] || point[d][i] >= b[3+d]) k = 0;
+      }
+    }
+
+    if (!k) errors[0] ++;
+  }
+
+  MPI_Allreduce (&errors[0], &errors[1], 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+  return errors[1];
+}
+
+/* squared distance from p to a box, lower then upper corner */
+REAL box_distance2 (REAL *b, REAL p[3])
+{
+  REAL s = 0.0, t;
+  int d;
+
+  for (d = 0; d < 3; d ++)
+  {
+    t = MAX (MAX (b[d] - p[d], p[d] - b[3+d]), 0.0);
+
+    s += t*t;
+  }
+
+  return s;
+}
+
+/* check that counting ghost ranks (ranks == NULL) agrees with filling them and that the ranks of each local point
+ * are exactly the other ranks with a region within radius, found by brute force over dynlb_rank_extents; lb must
+ * not use DYNLB_LEAF_BOXES, which drops ranks without points nearby; return the number of failures */
+int check_ghosts (struct dynlb *lb, int n, REAL *point[3], REAL radius)
+{
+  int i, j, k, r, rank, size, total, count, found, *offsets[2], *ranks, errors[2];
+  REAL *boxes;
+
+  MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+  MPI_Comm_size (MPI_COMM_WORLD, &size);
+
+  ERRMEM (offsets[0] = malloc ((n+1) * sizeof (int)));
+  ERRMEM (offsets[1] = malloc ((n+1) * sizeof (int)));
+
+  total = dynlb_ghosts (lb, n, point, radius, offsets[0], NULL);
+
+  ERRMEM (ranks = malloc (MAX(total,1) * sizeof (int)));
+
+  errors[0] = dynlb_ghosts (lb, n, point, radius, offsets[1], ranks) != total;
+
+  for (i = 0; i <= n; i ++)
+  {
+    if (offsets[0][i] != offsets[1][i]) errors[0] ++;
+  }
+
+  for (i = 0; i < n && !errors[0]; i ++)
+  {
+    REAL p[3] = {point[0][i], point[1][i], point[2][i]};
+
+    for (j = offsets[1][i]; j < offsets[1][i+1]; j ++)
+    {
+      if (ranks[j] == rank) errors[0] ++;
+
+      for (k = offsets[1][i]; k < j; k ++) errors[0] += ranks[k] == ranks[j];
+    }
+
+    for (found = r = 0; r < size; r ++)
+    {
+      if (r == rank) continue;
+
+      dynlb_rank_extents (lb, r, &boxes, &count);
+
+      for (k = 0; k < count; k ++)
+      {
+	if (box_distance2 (&boxes[6*k], p) <= radius*radius) break;
+      }
+
+      if (k < count) /* rank r needs a ghost copy */
+      {
+	for (j = offsets[1][i]; j < offsets[1][i+1]; j ++) if (ranks[j] == r) break;
+
+	if (j == offsets[1][i+1]) errors[0] ++;
+
+	found ++;
+      }
+    }
+
+    if (found != offsets[1][i+1] - offsets[1][i]) errors[0] ++;
+  }
+
+  MPI_Allreduce (&errors[0], &errors[1], 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+  free (offsets[0]);
+  free (offsets[1]);
+  free (ranks);
+
+  return errors[1];
+}
+
+/* check that the eight way query tree of DYNLB_WIDE_TREE assigns the same ranks as the binary one, for the points
+ * and for as many random points spread beyond the unit cube; return the number of failures */
+int check_wide_tree (int n, REAL *point[3])
+{
+  struct dynlb *lb[2];
+  int i, d, *ranks[2], errors[2];
+  REAL *query[3];
+
+  lb[0] = dynlb_create_comm (MPI_COMM_WORLD, 0, n, point, 0, 0.5, DYNLB_RCB_TREE, 0);
+  lb[1] = dynlb_create_comm (MPI_COMM_WORLD, 0, n, point, 0, 0.5, DYNLB_RCB_TREE, DYNLB_WIDE_TREE);
+
+  for (d = 0; d < 3; d ++)
+  {
+    ERRMEM (query[d] = malloc (MAX(2*n,1) * sizeof (REAL)));
+
+    for (i = 0; i < n; i ++)
+    {
+      query[d][i] = point[d][i];
+      query[d][n+i] = 1.2*DRAND()-0.1;
+    }
+  }
+
+  ERRMEM (ranks[0] = malloc (MAX(2*n,1) * sizeof (int)));
+  ERRMEM (ranks[1] = malloc (MAX(2*n,1) * sizeof (int)));
+
+  dynlb_points_assign (lb[0], 2*n, query, ranks[0]);
+  dynlb_points_assign (lb[1], 2*n, query, ranks[1]);
+
+  for (i = errors[0] = 0; i < 2*n; i ++)
+  {
+    REAL p[3] = {query[0][i], query[1][i], query[2][i]};
+
+    if (ranks[0][i] != ranks[1][i] || dynlb_point_assign (lb[1], p) != ranks[0][i]) errors[0] ++;
+  }
+
+  MPI_Allreduce (&errors[0], &errors[1], 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+  for (d = 0; d < 3; d ++) free (query[d]);
+  free (ranks[0]);
+  free (ranks[1]);
+
+  dynlb_destroy (lb[0]);
+  dynlb_destroy (lb[1]);
+
+  return errors[1];
+}
+
+/* create a balancer with the given partitioning, time its updates, migrate points and check queries; return the number of failures */
+int check_part (enum dynlb_part part, int flags, char *name, int num_time_steps, REAL time_step, int *n, REAL *point[3], REAL *velo[3])
+{
+  int m, i, rank, size, errors, attr_size[4] = {sizeof (REAL), sizeof (REAL), sizeof (REAL), sizeof (REAL)};
+  struct timing t;
+  double dt[2], gt[2];
+  void *attr[4];
+
+  MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+
+  MPI_Comm_size (MPI_COMM_WORLD, &size);
+
+  if (rank == 0) printf ("Creating %s partitioning tree based balancer ...\n", name);
+
+  timerstart (&t);
+
+  struct dynlb *lb = dynlb_create_comm (MPI_COMM_WORLD, 0, *n, point, 0, 0.5, part, flags);
+
+  dt[0] = ptimerend (&t);
+
+  if (rank == 0) printf ("Took %g sec.\nInitial imbalance %g\n", dt[0], lb->imbalance);
+
+  if (rank == 0) printf ("Timing %d partitioning tree based balancing steps...\n", num_time_steps);
+
+  for (i = 0, dt[0] = 0.0, dt[1] = 0.0; i < num_time_steps; i ++)
+  {
+    timerstart (&t);
+
+    dynlb_update (lb, *n, point);
+
+    dt[0] += timerend (&t);
+
+    if (rank == 0) printf ("Step %d imbalance %g\n", i, lb->imbalance);
+
+    timerstart (&t);
+
+    unit_cube_step (0, *n, point, velo, time_step);
+
+    dt[1] += timerend (&t);
+  }
+
+  MPI_Allreduce (dt, gt, 2, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+
+  gt[0] /= (double)size * (double)num_time_steps;
+  gt[1] /= (double)size * (double)num_time_steps;
+
+  if (rank == 0) printf ("%s: avg. integration: %g sec. per step, avg. balancing: %g sec. per step; ratio: %g\n", name, gt[0]+gt[1], gt[1], gt[1]/(gt[0]+gt[1]));
+
+  if (rank == 0) printf ("Migrating points with attributes ...\n");
+
+  ERRMEM (attr[0] = malloc (MAX(*n,1) * sizeof (REAL)));
+  attr[1] = velo[0]; /* velocities travel with their points */
+  attr[2] = velo[1];
+  attr[3] = velo[2];
+
+  for (i = 0; i < *n; i ++) ((REAL*)attr[0])[i] = point[0][i];
+
+  m = *n;
+
+  *n = dynlb_migrate (lb, *n, point, 4, attr, attr_size);
+
+  errors = check_migration (lb, m, *n, point, attr[0]);
+
+  if (rank == 0) printf ("Blocking migration %s\n", errors ? "FAILED" : "passed");
+
+  for (i = 0; i < *n; i ++) /* mirror points so that most of them change ranks */
+  {
+    point[0][i] = 1.0 - point[0][i];
+    ((REAL*)attr[0])[i] = point[0][i];
+  }
+
+  dynlb_update (lb, *n, point);
+
+  m = *n;
+
+  struct dynlb_migration *mig = dynlb_migrate_begin (lb, *n, point, 4, attr, attr_size);
+
+  *n = dynlb_migrate_end (mig, point, attr);
+
+  i = check_migration (lb, m, *n, point, attr[0]);
+
+  if (rank == 0) printf ("Nonblocking migration %s\n", i ? "FAILED" : "passed");
+
+  errors += i;
+
+  velo[0] = attr[1];
+  velo[1] = attr[2];
+  velo[2] = attr[3];
+
+  free (attr[0]);
+
+  i = check_points_assign (lb, *n, point);
+
+  if (rank == 0) printf ("Batched point assignment %s\n", i ? "FAILED" : "passed");
+
+  errors += i;
+
+  i = check_boxes_assign (lb, *n, point);
+
+  if (rank == 0) printf ("Batched box assignment %s\n", i ? "FAILED" : "passed");
+
+  errors += i;
+
+  i = check_rank_extents (lb, *n, point);
+
+  if (rank == 0) printf ("Rank extents %s\n", i ? "FAILED" : "passed");
+
+  errors += i;
+
+  i = check_ghosts (lb, *n, point, 0.1);
+
+  if (rank == 0) printf ("Ghost ranks %s\n", i ? "FAILED" : "passed");
+
+  errors += i;
+
+  dynlb_destroy (lb);
+
+  return errors;
+}
+
 int main (int argc, char *argv[])
 {
   int max_points_per_rank = 100;
   int num_time_steps = 100;
   REAL time_step = 0.001;
-  int n, i, rank, size, *ranks;
+  struct { enum dynlb_part part; int flags; char *name; } tests[] = /* partitioners exercised by check_part */
+  {
+    {DYNLB_RCB_TREE, 0, "RCB"},
+    {DYNLB_PRCB_TREE, 0, "PRCB"},
+    {DYNLB_HRCB_TREE, 0, "HRCB"},
+    {DYNLB_MJ_TREE, 0, "MJ"},
+    {DYNLB_RADIX_TREE, DYNLB_SHARED_TREE, "SHARED RADIX"}
+  };
+  int n, i, k, rank, size, *ranks, errors;
   REAL *point[3], *velo[3];
   struct timing t;
   double dt[2], gt[2];
@@ -131,41 +529,16 @@ int main (int argc, char *argv[])
 
   if (rank == 0) printf ("\nMORTON: avg. integration: %g sec. per step, avg. balancing: %g sec. per step; ratio: %g\n", gt[0]+gt[1], gt[1], gt[1]/(gt[0]+gt[1]));
 
-  if (rank == 0) printf ("Creating partitioning tree based balancer ...\n");
-
-  timerstart (&t);
-
-  struct dynlb *lb = dynlb_create (0, n, point, 0, 0.5, DYNLB_RCB_TREE);
-
-  dt[0] += ptimerend (&t);
-
-  if (rank == 0) printf ("Took %g sec.\nInitial imbalance %g\n", dt[0], lb->imbalance);
-
-  if (rank == 0) printf ("Timing %d partitioning tree based balancing steps...\n", num_time_steps);
-
-  for (i = 0, dt[0] = 0.0, dt[1] = 0.0; i < num_time_steps; i ++)
+  for (k = 0, errors = 0; k < sizeof (tests) / sizeof (tests[0]); k ++)
   {
-    timerstart (&t);
-
-    dynlb_update (lb, n, point);
-
-    dt[0] += timerend (&t);
-
-    if (rank == 0) printf ("Step %d imbalance %g\n", i, lb->imbalance);
-
-    timerstart (&t);
-
-    unit_cube_step (0, n, point, velo, time_step);
-
-    dt[1] += timerend (&t);
+    errors += check_part (tests[k].part, tests[k].flags, tests[k].name, num_time_steps, time_step, &n, point, velo);
   }
 
-  MPI_Allreduce (dt, gt, 2, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+  i = check_wide_tree (n, point);
 
-  gt[0] /= (double)size * (double)num_time_steps;
-  gt[1] /= (double)size * (double)num_time_steps;
+  if (rank == 0) printf ("Wide tree assignment %s\n", i ? "FAILED" : "passed");
 
-  if (rank == 0) printf ("TREE: avg. integration: %g sec. per step, avg. balancing: %g sec. per step; ratio: %g\n", gt[0]+gt[1], gt[1], gt[1]/(gt[0]+gt[1]));
+  errors += i;
 
   free (point[0]);
   free (point[1]);
@@ -177,5 +550,5 @@ int main (int argc, char *argv[])
 
   MPI_Finalize ();
 
-  return 0;
+  return errors ? 1 : 0;
 }